@@ -0,0 +1,1178 @@
+#define _GNU_SOURCE /* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include "blkwrite.h"
+#include "crc32.h"
+#include "config.h"
+#include "trace.h"
+#include "log.h"
+#include "clock.h"
+
+#define BLK_BUFFER_SIZE (1024 * 1024)
+
+/* Memory alignment for O_DIRECT, whatever the sector size */
+#define BLK_ALIGN       4096
+
+/* Writes kept in flight at once, unless "write_queue_depth" says
+ * otherwise.  One more buffer than this fills while they're written. */
+#define DEFAULT_DEPTH   4
+#define MAX_DEPTH       32
+
+/* The fallback never runs more than this many pwrite() threads */
+#define MAX_THREADS     4
+
+/* fdatasync() after this much, unless "write_sync_mb" says otherwise.
+ * 0 means only sync when closing. */
+#define DEFAULT_SYNC_MB 16
+
+/* Individual writes slower than this get logged */
+#define SLOW_WRITE_US   250000
+
+/* Latency histogram: bucket n counts writes taking under 2^n us */
+#define LATENCY_BUCKETS 32
+
+/* Times a region that reads back wrong is written again */
+#define VERIFY_RETRIES  2
+
+struct blk_buffer {
+    char *data;
+    size_t len;
+    off_t offset;               /* where on the device it goes */
+    size_t done;                /* bytes written so far */
+    int busy;                   /* being written or verified */
+    unsigned long long submit_us;
+};
+
+struct blk_writer;
+
+/*
+ * How buffers get to the device.  submit() starts writing a full
+ * buffer; reap(all) waits until one buffer is free, or until none are
+ * busy, and returns -1 once any write has failed.
+ */
+struct blk_backend {
+    const char *name;
+    int (*start)(struct blk_writer *w);
+    int (*submit)(struct blk_writer *w, struct blk_buffer *b);
+    int (*reap)(struct blk_writer *w, int all);
+    void (*stop)(struct blk_writer *w);
+};
+
+#ifdef HAVE_IO_URING
+struct uring {
+    int fd;
+    char *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct blk_writer {
+    char path[64];
+    int fd;
+    int direct;
+    unsigned block_size;
+
+    const struct blk_backend *backend;
+    int depth;
+    int nbufs;
+    struct blk_buffer *buf;
+    struct blk_buffer *cur;     /* the one filling */
+    off_t next_offset;          /* for the buffer after that */
+    int inflight;
+    int error;
+
+    /* Busy buffers queue up for the pwrite() threads in order */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t threads[MAX_THREADS];     /* or the io_uring reaper */
+    int nthreads;
+    struct blk_buffer **queue;
+    unsigned queue_head, queue_tail;
+    int closing;
+
+#ifdef HAVE_IO_URING
+    struct uring ring;
+#endif
+
+    /* Written buffers queue up to be read back, unless "verify_writes"
+     * is 0.  They stay busy until they check out. */
+    int verify;
+    int verify_fd;
+    char *verify_buf;
+    pthread_t verify_thread;
+    pthread_cond_t verify_work;
+    struct blk_buffer **verify_queue;
+    unsigned verify_head, verify_tail;
+    int verify_stop;
+    unsigned verify_regions, verify_bad, verify_rewrites;
+    off_t verify_bytes;
+    unsigned long long verify_us;
+
+    /* blk_skip_unchanged(): buffers that match the device aren't written */
+    int compare_fd;
+    char *compare_buf;
+    off_t skipped;
+
+    /* blk_prepare(): the device reads back zeroes from zero_start to
+     * zero_end, so all-zero buffers in there needn't be written */
+    const char *prepare;
+    unsigned long long prepare_us;
+    off_t zero_start, zero_end;
+    off_t zeroes;
+
+    /* "write_latency_us": each write takes at least this long, to stand
+     * in for a slow card.  Only the pwrite() threads do it. */
+    unsigned latency_us;
+
+    off_t sync_bytes;
+    off_t unsynced;
+    off_t synced_to;
+    off_t max_end;
+    off_t written;
+
+    unsigned requests;
+    unsigned long long total_us, max_us;
+    unsigned latency[LATENCY_BUCKETS];
+};
+
+/* Some drivers only refuse O_DIRECT once asked to write.  Returns 1 if
+ * the write should be tried again. */
+static int drop_direct(struct blk_writer *w, int err) {
+    if (err != EINVAL || !w->direct || w->written)
+        return 0;
+    NOTE("%s rejected O_DIRECT, using buffered writes", w->path);
+    fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+    w->direct = 0;
+    return 1;
+}
+
+static void finish_buffer(struct blk_writer *w, struct blk_buffer *b) {
+    b->busy = 0;
+    w->inflight--;
+}
+
+/* Bookkeeping once a buffer is on the device, or has failed.  Called
+ * with w->lock held. */
+static void complete_buffer(struct blk_writer *w, struct blk_buffer *b, int ok) {
+    unsigned long long us = monotonic_us() - b->submit_us;
+    int bucket = 0;
+
+    if (!ok)
+        w->error = 1;
+    else {
+        w->written += b->len;
+        if (b->offset + (off_t)b->len > w->max_end)
+            w->max_end = b->offset + b->len;
+    }
+
+    trace_span("blk", "write", b->submit_us, us);
+    trace_counter("blk", "inflight", w->inflight);
+
+    w->requests++;
+    w->total_us += us;
+    if (us > w->max_us)
+        w->max_us = us;
+    while (bucket < LATENCY_BUCKETS - 1 && (1ULL << bucket) <= us)
+        bucket++;
+    w->latency[bucket]++;
+    if (us > SLOW_WRITE_US)
+        NOTE("blk_write_slow offset=%lld len=%zu us=%llu",
+            (long long)b->offset, b->len, us);
+
+    if (ok && w->verify) {
+        w->verify_queue[w->verify_head++ % w->nbufs] = b;
+        pthread_cond_signal(&w->verify_work);
+    }
+    else
+        finish_buffer(w, b);
+}
+
+
+/* Shared by both backends: the I/O threads complete buffers under
+ * w->lock and signal w->done */
+static int wait_buffers(struct blk_writer *w, int all) {
+    int error;
+
+    pthread_mutex_lock(&w->lock);
+    while (all ? w->inflight > 0 : w->inflight >= w->nbufs)
+        pthread_cond_wait(&w->done, &w->lock);
+    error = w->error;
+    pthread_mutex_unlock(&w->lock);
+    return error ? -1 : 0;
+}
+
+
+/* The fallback: a few threads each doing one pwrite() at a time */
+static void *pool_main(void *arg) {
+    struct blk_writer *w = arg;
+    struct blk_buffer *b;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->queue_head == w->queue_tail && !w->closing)
+            pthread_cond_wait(&w->work, &w->lock);
+        if (w->queue_head == w->queue_tail)
+            break;
+        b = w->queue[w->queue_tail++ % w->nbufs];
+        pthread_mutex_unlock(&w->lock);
+
+        if (w->latency_us)
+            usleep(w->latency_us);
+        while (b->done < b->len && !w->error) {
+            ssize_t n = pwrite(w->fd, b->data + b->done, b->len - b->done,
+                               b->offset + b->done);
+            if (n < 0 && (errno == EINTR || drop_direct(w, errno)))
+                continue;
+            if (n <= 0) {
+                PERROR("Unable to write %s at %lld", w->path,
+                    (long long)(b->offset + b->done));
+                break;
+            }
+            b->done += n;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        complete_buffer(w, b, b->done == b->len);
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static int pool_start(struct blk_writer *w) {
+    w->queue = calloc(w->nbufs, sizeof(*w->queue));
+    if (!w->queue)
+        return -1;
+    pthread_cond_init(&w->work, NULL);
+
+    for (w->nthreads = 0; w->nthreads < w->depth && w->nthreads < MAX_THREADS;
+         w->nthreads++) {
+        if (pthread_create(&w->threads[w->nthreads], NULL, pool_main, w)) {
+            PERROR("Unable to start write thread");
+            break;
+        }
+    }
+    return w->nthreads ? 0 : -1;
+}
+
+static int pool_submit(struct blk_writer *w, struct blk_buffer *b) {
+    pthread_mutex_lock(&w->lock);
+    b->busy = 1;
+    w->inflight++;
+    w->queue[w->queue_head++ % w->nbufs] = b;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static void pool_stop(struct blk_writer *w) {
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_broadcast(&w->work);
+    pthread_mutex_unlock(&w->lock);
+    for (i = 0; i < w->nthreads; i++)
+        pthread_join(w->threads[i], NULL);
+
+    pthread_cond_destroy(&w->work);
+    free(w->queue);
+}
+
+static const struct blk_backend pool_backend = {
+    .name = "pwrite",
+    .start = pool_start,
+    .submit = pool_submit,
+    .reap = wait_buffers,
+    .stop = pool_stop,
+};
+
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring, without liburing: every buffer is registered with the
+ * kernel once, and written with IORING_OP_WRITE_FIXED.  A thread reaps
+ * completions as they arrive, so the latencies are the device's.
+ */
+
+/* user_data for the no-op that wakes the reaper up to exit */
+#define URING_WAKE_UP   (~0ULL)
+static int uring_enter(struct uring *r, unsigned submit, unsigned wait) {
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+/* Queue the rest of b, or a no-op if b is NULL.  Called with w->lock
+ * held, as both threads submit. */
+static int uring_queue(struct blk_writer *w, struct blk_buffer *b) {
+    struct uring *r = &w->ring;
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (b) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = w->fd;
+        sqe->addr = (uintptr_t)(b->data + b->done);
+        sqe->len = b->len - b->done;
+        sqe->off = b->offset + b->done;
+        sqe->buf_index = b - w->buf;
+        sqe->user_data = b - w->buf;
+    }
+    else {
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = URING_WAKE_UP;
+    }
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (uring_enter(r, 1, 0) < 0) {
+        PERROR("Unable to queue write to %s", w->path);
+        return -1;
+    }
+    return 0;
+}
+
+static void uring_unmap(struct blk_writer *w) {
+    struct uring *r = &w->ring;
+
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr)
+        munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+/* Handle every completion that's arrived */
+static void uring_complete(struct blk_writer *w) {
+    struct uring *r = &w->ring;
+    unsigned head = *r->cq_head;
+
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct blk_buffer *b;
+        int res = cqe->res;
+
+        head++;
+        if (cqe->user_data == URING_WAKE_UP) {
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+            continue;
+        }
+        b = &w->buf[cqe->user_data];
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+        if (res < 0 && (res == -EINTR || res == -EAGAIN
+                     || drop_direct(w, -res))) {
+            if (!uring_queue(w, b))
+                continue;
+        }
+        else if (res < 0) {
+            errno = -res;
+            PERROR("Unable to write %s at %lld", w->path,
+                (long long)(b->offset + b->done));
+        }
+        else if (res > 0) {
+            b->done += res;
+            if (b->done < b->len && !uring_queue(w, b))
+                continue;
+        }
+        else
+            ERROR("Device %s is full at %lld", w->path,
+                (long long)(b->offset + b->done));
+        complete_buffer(w, b, b->done == b->len);
+    }
+}
+
+static void *uring_main(void *arg) {
+    struct blk_writer *w = arg;
+    int i, done = 0;
+
+    while (!done) {
+        int ret = uring_enter(&w->ring, 0, 1);
+
+        pthread_mutex_lock(&w->lock);
+        if (ret < 0) {
+            /* Nothing will ever complete now */
+            PERROR("Unable to wait for writes to %s", w->path);
+            for (i = 0; i < w->nbufs; i++)
+                if (w->buf[i].busy)
+                    complete_buffer(w, &w->buf[i], 0);
+            done = 1;
+        }
+        else
+            uring_complete(w);
+        if (w->closing && !w->inflight)
+            done = 1;
+        pthread_cond_broadcast(&w->done);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+static int uring_start(struct blk_writer *w) {
+    struct uring *r = &w->ring;
+    struct io_uring_params p;
+    struct iovec iov[MAX_DEPTH + 1];
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, w->nbufs, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    r->sq_head = (unsigned *)(r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)(r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)(r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)(r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(r->cq_ptr + p.cq_off.cqes);
+
+    for (i = 0; i < w->nbufs; i++) {
+        iov[i].iov_base = w->buf[i].data;
+        iov[i].iov_len = BLK_BUFFER_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                iov, w->nbufs) < 0)
+        goto fail;
+
+    if (pthread_create(&w->threads[0], NULL, uring_main, w))
+        goto fail;
+    w->nthreads = 1;
+    return 0;
+
+ fail:
+    PERROR("Unable to set up io_uring");
+    uring_unmap(w);
+    memset(r, 0, sizeof(*r));
+    return -1;
+}
+
+static int uring_submit(struct blk_writer *w, struct blk_buffer *b) {
+    int ret;
+
+    pthread_mutex_lock(&w->lock);
+    b->busy = 1;
+    w->inflight++;
+    ret = uring_queue(w, b);
+    if (ret)
+        complete_buffer(w, b, 0);
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+static void uring_stop(struct blk_writer *w) {
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    uring_queue(w, NULL);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->threads[0], NULL);
+    uring_unmap(w);
+}
+
+static const struct blk_backend uring_backend = {
+    .name = "io_uring",
+    .start = uring_start,
+    .submit = uring_submit,
+    .reap = wait_buffers,
+    .stop = uring_stop,
+};
+#endif /* HAVE_IO_URING */
+
+
+/*
+ * Read-back verification.  Each region is read from the device again,
+ * past the page cache, while later regions are still being written.
+ * If its checksum differs from the data we handed over, it's written
+ * again on the spot.
+ */
+
+/* Read what's on the device where b goes into buf, which has room for
+ * a sector either side.  Returns where in buf it starts, or NULL. */
+static char *read_region(struct blk_writer *w, int fd, char *buf,
+                         struct blk_buffer *b) {
+    off_t start = b->offset - b->offset % w->block_size;
+    size_t skip = b->offset - start;
+    size_t want = skip + b->len;
+    size_t got = 0;
+
+    want += (w->block_size - want % w->block_size) % w->block_size;
+    while (got < skip + b->len) {
+        ssize_t n = pread(fd, buf + got, want - got, start + got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            PERROR("Unable to read back %s at %lld", w->path,
+                (long long)(start + got));
+            return NULL;
+        }
+        got += n;
+    }
+    return buf + skip;
+}
+
+/* Checksum what's on the device where b went */
+static int read_back(struct blk_writer *w, struct blk_buffer *b, uint32_t *crc) {
+    unsigned long long begin = monotonic_us();
+    char *data = read_region(w, w->verify_fd, w->verify_buf, b);
+
+    if (!data)
+        return -1;
+    *crc = crc32_update(0, data, b->len);
+
+    w->verify_us += monotonic_us() - begin;
+    w->verify_bytes += b->len;
+    return 0;
+}
+
+static int rewrite_region(struct blk_writer *w, struct blk_buffer *b) {
+    size_t done = 0;
+
+    while (done < b->len) {
+        ssize_t n = pwrite(w->fd, b->data + done, b->len - done,
+                           b->offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            PERROR("Unable to rewrite %s at %lld", w->path,
+                (long long)(b->offset + done));
+            return -1;
+        }
+        done += n;
+    }
+    if (fdatasync(w->fd)) {
+        PERROR("Unable to sync %s", w->path);
+        return -1;
+    }
+    return 0;
+}
+
+static int verify_region(struct blk_writer *w, struct blk_buffer *b) {
+    uint32_t expected = crc32_update(0, b->data, b->len);
+    uint32_t actual;
+    int tries;
+
+    w->verify_regions++;
+    for (tries = 0; ; tries++) {
+        if (read_back(w, b, &actual))
+            return -1;
+        if (actual == expected) {
+            if (tries)
+                NOTE("blk_verify_fixed offset=%lld len=%zu rewrites=%d",
+                    (long long)b->offset, b->len, tries);
+            return 0;
+        }
+
+        NOTE("blk_verify_bad offset=%lld len=%zu want=%08x got=%08x",
+            (long long)b->offset, b->len, expected, actual);
+        if (!tries)
+            w->verify_bad++;
+        if (tries == VERIFY_RETRIES) {
+            ERROR("%s at %lld still reads back wrong after %d rewrites",
+                w->path, (long long)b->offset, tries);
+            return -1;
+        }
+        if (rewrite_region(w, b))
+            return -1;
+        w->verify_rewrites++;
+    }
+}
+
+static void *verify_main(void *arg) {
+    struct blk_writer *w = arg;
+    struct blk_buffer *b;
+    int ret;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->verify_head == w->verify_tail && !w->verify_stop)
+            pthread_cond_wait(&w->verify_work, &w->lock);
+        if (w->verify_head == w->verify_tail)
+            break;
+        b = w->verify_queue[w->verify_tail++ % w->nbufs];
+        pthread_mutex_unlock(&w->lock);
+
+        ret = w->error ? -1 : verify_region(w, b);
+
+        pthread_mutex_lock(&w->lock);
+        if (ret)
+            w->error = 1;
+        finish_buffer(w, b);
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* Reading back needs a descriptor that skips the page cache, or it
+ * would only see what we just wrote */
+static void start_verify(struct blk_writer *w) {
+    const char *setting = config_get("verify_writes");
+
+    if (setting && !strtoul(setting, NULL, 0))
+        return;
+
+    w->verify_fd = open(w->path, O_RDONLY | O_DIRECT);
+    if (w->verify_fd == -1) {
+        PERROR("Can't read %s back past the cache, not verifying", w->path);
+        return;
+    }
+    w->verify_queue = calloc(w->nbufs, sizeof(*w->verify_queue));
+    if (!w->verify_queue
+     || posix_memalign((void **)&w->verify_buf, BLK_ALIGN,
+                       BLK_BUFFER_SIZE + 2 * BLK_ALIGN)) {
+        ERROR("Out of memory for verification, not verifying");
+        return;
+    }
+    pthread_cond_init(&w->verify_work, NULL);
+    if (pthread_create(&w->verify_thread, NULL, verify_main, w)) {
+        PERROR("Unable to start verify thread, not verifying");
+        pthread_cond_destroy(&w->verify_work);
+        return;
+    }
+    w->verify = 1;
+}
+
+static void stop_verify(struct blk_writer *w) {
+    if (!w->verify)
+        return;
+    pthread_mutex_lock(&w->lock);
+    w->verify_stop = 1;
+    pthread_cond_signal(&w->verify_work);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->verify_thread, NULL);
+    pthread_cond_destroy(&w->verify_work);
+
+    if (w->verify_regions)
+        NOTE("blk_verify_stats path=%s regions=%u bytes=%lld bad=%u "
+             "rewrites=%u read_kib_s=%llu",
+            w->path, w->verify_regions, (long long)w->verify_bytes,
+            w->verify_bad, w->verify_rewrites,
+            w->verify_us ? (w->verify_bytes * 1000000ULL / w->verify_us) >> 10
+                         : 0);
+}
+
+
+/* Only called with nothing in flight */
+static int sync_writer(struct blk_writer *w) {
+    if (fdatasync(w->fd)) {
+        PERROR("Unable to sync %s", w->path);
+        return -1;
+    }
+    /* Buffered writes leave clean pages behind, which we'll never read */
+    if (!w->direct && w->max_end > w->synced_to)
+        posix_fadvise(w->fd, w->synced_to, w->max_end - w->synced_to,
+                      POSIX_FADV_DONTNEED);
+    w->synced_to = w->max_end;
+    w->unsynced = 0;
+    return 0;
+}
+
+static int unchanged(struct blk_writer *w, struct blk_buffer *b) {
+    char *data;
+
+    if (w->compare_fd == -1)
+        return 0;
+    data = read_region(w, w->compare_fd, w->compare_buf, b);
+    if (!data || memcmp(data, b->data, b->len))
+        return 0;
+    w->skipped += b->len;
+    return 1;
+}
+
+static int already_zero(struct blk_writer *w, struct blk_buffer *b) {
+    if (b->offset < w->zero_start
+     || b->offset + (off_t)b->len > w->zero_end
+     || !b->len || b->data[0] || memcmp(b->data, b->data + 1, b->len - 1))
+        return 0;
+    w->zeroes += b->len;
+    return 1;
+}
+
+/* Start writing the filling buffer, and move on to a free one */
+static int submit_buffer(struct blk_writer *w) {
+    struct blk_buffer *b = w->cur;
+    int i;
+
+    if (already_zero(w, b) || unchanged(w, b)) {
+        b->len = 0;
+        b->offset = w->next_offset;
+        w->next_offset += BLK_BUFFER_SIZE;
+        return 0;
+    }
+
+    b->done = 0;
+    b->submit_us = monotonic_us();
+    if (w->backend->submit(w, b))
+        return -1;
+    w->unsynced += b->len;
+
+    if (w->sync_bytes && w->unsynced >= w->sync_bytes) {
+        if (w->backend->reap(w, 1) || sync_writer(w))
+            return -1;
+    }
+    else if (w->backend->reap(w, 0))
+        return -1;
+
+    for (i = 0; w->buf[i].busy; i++)
+        ;
+    w->cur = &w->buf[i];
+    w->cur->len = 0;
+    w->cur->offset = w->next_offset;
+    w->next_offset += BLK_BUFFER_SIZE;
+    return 0;
+}
+
+/* O_DIRECT can only write whole sectors, so a partial one at either
+ * end is filled in from what's on the device already */
+static int read_sector(struct blk_writer *w, char *dst, off_t sector) {
+    ssize_t n;
+
+    do {
+        n = pread(w->fd, dst, w->block_size, sector);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)w->block_size) {
+        PERROR("Unable to read %s at %lld", w->path, (long long)sector);
+        return -1;
+    }
+    return 0;
+}
+
+static int pad_last_sector(struct blk_writer *w, struct blk_buffer *b) {
+    size_t partial = b->len % w->block_size;
+    size_t start = b->len - partial;
+    char *sector;
+    int ret;
+
+    if (posix_memalign((void **)&sector, BLK_ALIGN, w->block_size))
+        return -1;
+    ret = read_sector(w, sector, b->offset + start);
+    if (!ret) {
+        memcpy(b->data + b->len, sector + partial, w->block_size - partial);
+        b->len = start + w->block_size;
+    }
+    free(sector);
+    return ret;
+}
+
+/* Point the (empty) filling buffer at offset.  It starts on a sector
+ * boundary, keeping whatever's in front of offset. */
+static int start_at(struct blk_writer *w, off_t offset) {
+    struct blk_buffer *b = w->cur;
+
+    b->len = 0;
+    b->offset = offset;
+    if (w->direct && offset % w->block_size) {
+        b->len = offset % w->block_size;
+        b->offset = offset - b->len;
+        if (read_sector(w, b->data, b->offset))
+            return -1;
+    }
+    w->next_offset = b->offset + BLK_BUFFER_SIZE;
+    return 0;
+}
+
+static void report_writer(struct blk_writer *w) {
+    unsigned long long p50 = 0, p99 = 0;
+    unsigned seen = 0;
+    int i;
+
+    if (w->prepare)
+        NOTE("blk_prepare_stats path=%s method=%s ms=%llu zeroes=%lld",
+            w->path, w->prepare, w->prepare_us / 1000,
+            (long long)w->zeroes);
+    if (!w->requests) {
+        if (w->skipped)
+            NOTE("blk_write_stats path=%s requests=0 skipped=%lld",
+                w->path, (long long)w->skipped);
+        return;
+    }
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += w->latency[i];
+        if (!p50 && seen * 2 >= w->requests)
+            p50 = 1ULL << i;
+        if (!p99 && seen * 100 >= w->requests * 99ULL)
+            p99 = 1ULL << i;
+    }
+    NOTE("blk_write_stats path=%s backend=%s depth=%d direct=%d "
+         "requests=%u bytes=%lld skipped=%lld avg_us=%llu p50_us<%llu "
+         "p99_us<%llu max_us=%llu",
+        w->path, w->backend->name, w->depth, w->direct, w->requests,
+        (long long)w->written, (long long)w->skipped,
+        w->total_us / w->requests, p50, p99, w->max_us);
+}
+
+static void free_writer(struct blk_writer *w) {
+    int i;
+
+    for (i = 0; i < w->nbufs; i++)
+        free(w->buf[i].data);
+    free(w->buf);
+    free(w->verify_queue);
+    free(w->verify_buf);
+    free(w->compare_buf);
+    if (w->verify_fd != -1)
+        close(w->verify_fd);
+    if (w->compare_fd != -1)
+        close(w->compare_fd);
+    if (w->fd != -1)
+        close(w->fd);
+    free(w);
+}
+
+static int start_backend(struct blk_writer *w) {
+#ifdef HAVE_IO_URING
+    w->backend = &uring_backend;
+    if (!w->latency_us && !w->backend->start(w))
+        return 0;
+    if (!w->latency_us)
+        NOTE("io_uring isn't available, falling back to pwrite threads");
+#endif
+    w->backend = &pool_backend;
+    return w->backend->start(w);
+}
+
+struct blk_writer *open_blk_writer(const char *path, int flags, off_t offset) {
+    struct blk_writer *w;
+    const char *setting;
+    struct stat st;
+    int i;
+
+    w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    w->block_size = 512;
+    w->verify_fd = -1;
+    w->compare_fd = -1;
+
+    w->fd = open(path, O_RDWR | flags, 0777);
+    if (w->fd == -1) {
+        PERROR("Unable to open %s", path);
+        free(w);
+        return NULL;
+    }
+
+    /* Only block devices get O_DIRECT; a file may be on a filesystem
+     * that can't do it, and is probably a simulation anyway */
+    if (!fstat(w->fd, &st) && S_ISBLK(st.st_mode)) {
+        int ssz;
+        if (!ioctl(w->fd, BLKSSZGET, &ssz) && ssz > 0 && ssz <= BLK_ALIGN)
+            w->block_size = ssz;
+        if (!fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_DIRECT))
+            w->direct = 1;
+        else
+            PERROR("%s won't do O_DIRECT, using buffered writes", path);
+    }
+
+    w->depth = DEFAULT_DEPTH;
+    setting = config_get("write_queue_depth");
+    if (setting)
+        w->depth = strtoul(setting, NULL, 0);
+    if (w->depth < 1)
+        w->depth = 1;
+    if (w->depth > MAX_DEPTH)
+        w->depth = MAX_DEPTH;
+
+    setting = config_get("write_latency_us");
+    if (setting)
+        w->latency_us = strtoul(setting, NULL, 0);
+
+    w->sync_bytes = (off_t)DEFAULT_SYNC_MB << 20;
+    setting = config_get("write_sync_mb");
+    if (setting)
+        w->sync_bytes = (off_t)strtoul(setting, NULL, 0) << 20;
+
+    w->nbufs = w->depth + 1;
+    w->buf = calloc(w->nbufs, sizeof(*w->buf));
+    if (!w->buf) {
+        free_writer(w);
+        return NULL;
+    }
+    for (i = 0; i < w->nbufs; i++) {
+        if (posix_memalign((void **)&w->buf[i].data, BLK_ALIGN,
+                           BLK_BUFFER_SIZE)) {
+            ERROR("Out of memory for write buffers");
+            free_writer(w);
+            return NULL;
+        }
+    }
+
+    w->cur = &w->buf[0];
+    if (start_at(w, offset)) {
+        free_writer(w);
+        return NULL;
+    }
+    w->synced_to = w->max_end = w->cur->offset;
+    lseek(w->fd, offset, SEEK_SET);
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->done, NULL);
+    if (start_backend(w)) {
+        ERROR("Unable to start writing %s", path);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->done);
+        free_writer(w);
+        return NULL;
+    }
+    start_verify(w);
+
+    NOTE("Writing %s at %lld: %s via %s, depth %d, %u-byte sectors, "
+         "sync every %lld MiB, %sverifying",
+        path, (long long)offset, w->direct ? "O_DIRECT" : "buffered",
+        w->backend->name, w->depth, w->block_size,
+        (long long)(w->sync_bytes >> 20), w->verify ? "" : "not ");
+    return w;
+}
+
+int blk_write(struct blk_writer *w, const void *buf, size_t len) {
+    while (len) {
+        struct blk_buffer *b = w->cur;
+        size_t n = BLK_BUFFER_SIZE - b->len;
+
+        if (n > len)
+            n = len;
+        memcpy(b->data + b->len, buf, n);
+        b->len += n;
+        buf = (const char *)buf + n;
+        len -= n;
+
+        if (b->len == BLK_BUFFER_SIZE && submit_buffer(w))
+            return -1;
+    }
+    return w->error ? -1 : 0;
+}
+
+int close_blk_writer(struct blk_writer *w) {
+    struct blk_buffer *b = w->cur;
+    int ret = 0;
+
+    if (b->len && !w->error) {
+        if (w->direct && b->len % w->block_size && pad_last_sector(w, b))
+            ret = -1;
+        else if (!already_zero(w, b) && !unchanged(w, b)) {
+            b->done = 0;
+            b->submit_us = monotonic_us();
+            if (w->backend->submit(w, b))
+                ret = -1;
+        }
+    }
+
+    if (w->backend->reap(w, 1) || sync_writer(w))
+        ret = -1;
+    w->backend->stop(w);
+    stop_verify(w);
+    report_writer(w);
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->done);
+    free_writer(w);
+    return ret;
+}
+
+void blk_skip_unchanged(struct blk_writer *w) {
+    w->compare_fd = open(w->path, O_RDONLY | O_DIRECT);
+    if (w->compare_fd == -1)
+        w->compare_fd = open(w->path, O_RDONLY);
+    if (w->compare_fd == -1) {
+        PERROR("Unable to read %s, writing everything", w->path);
+        return;
+    }
+    if (posix_memalign((void **)&w->compare_buf, BLK_ALIGN,
+                       BLK_BUFFER_SIZE + 2 * BLK_ALIGN)) {
+        close(w->compare_fd);
+        w->compare_fd = -1;
+    }
+}
+
+/* A queue setting of the disk under a block device, or -1.  Partitions
+ * share their disk's queue, one directory up. */
+static long long queue_setting(dev_t dev, const char *name) {
+    char path[96];
+    long long value;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s",
+             major(dev), minor(dev), name);
+    f = fopen(path, "r");
+    if (!f) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s",
+                 major(dev), minor(dev), name);
+        f = fopen(path, "r");
+    }
+    if (!f)
+        return -1;
+    if (fscanf(f, "%lld", &value) != 1)
+        value = -1;
+    fclose(f);
+    return value;
+}
+
+int blk_prepare(struct blk_writer *w, off_t length) {
+    const char *setting = config_get("write_prepare");
+    unsigned long long begin = monotonic_us();
+    off_t start = w->cur->offset;
+    int zeroes = 0, ret;
+    uint64_t range[2];
+    struct stat st;
+
+    if (setting && !strcmp(setting, "off"))
+        return -1;
+    if (w->requests || w->cur->len || fstat(w->fd, &st))
+        return -1;
+
+    if (S_ISREG(st.st_mode)) {
+        if (!length || start + length > st.st_size)
+            length = st.st_size - start;
+        if (length <= 0)
+            return -1;
+        w->prepare = "punch";
+        ret = fallocate(w->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        start, length);
+        zeroes = 1;
+    }
+    else if (S_ISBLK(st.st_mode)) {
+        uint64_t size;
+        if (ioctl(w->fd, BLKGETSIZE64, &size))
+            return -1;
+        if (!length || start + length > (off_t)size)
+            length = size - start;
+        length -= length % w->block_size;
+        if (length <= 0)
+            return -1;
+
+        /*
+         * A discard leaves erased blocks behind, which the card programs
+         * fastest, but only some cards promise they read back as zeroes.
+         * Cards that can write zeroes themselves do it with a command;
+         * anything else would just have the kernel write them out for us.
+         */
+        if (setting && !strcmp(setting, "zeroout"))
+            w->prepare = "zeroout";
+        else if (setting && !strcmp(setting, "discard"))
+            w->prepare = "discard";
+        else if (queue_setting(st.st_rdev, "discard_zeroes_data") == 1)
+            w->prepare = "discard";
+        else if (queue_setting(st.st_rdev, "write_zeroes_max_bytes") > 0)
+            w->prepare = "zeroout";
+        else if (queue_setting(st.st_rdev, "discard_max_bytes") > 0)
+            w->prepare = "discard";
+        else
+            return -1;
+
+        range[0] = start;
+        range[1] = length;
+        if (!strcmp(w->prepare, "zeroout")) {
+            ret = ioctl(w->fd, BLKZEROOUT, range);
+            zeroes = 1;
+        }
+        else {
+            ret = ioctl(w->fd, BLKDISCARD, range);
+            zeroes = queue_setting(st.st_rdev, "discard_zeroes_data") == 1;
+        }
+    }
+    else
+        return -1;
+
+    w->prepare_us = monotonic_us() - begin;
+    if (ret) {
+        PERROR("Unable to %s %s, writing all of it", w->prepare, w->path);
+        w->prepare = NULL;
+        return -1;
+    }
+    trace_span("blk", w->prepare, begin, w->prepare_us);
+    NOTE("blk_prepare path=%s method=%s offset=%lld bytes=%lld ms=%llu "
+         "skip_zeroes=%d", w->path, w->prepare, (long long)start,
+        (long long)length, w->prepare_us / 1000, zeroes);
+    if (!zeroes)
+        return -1;
+    w->zero_start = start;
+    w->zero_end = start + length;
+    return 0;
+}
+
+int blk_seek(struct blk_writer *w, off_t offset) {
+    struct blk_buffer *b = w->cur;
+    off_t at = b->offset + b->len;
+
+    if (w->error)
+        return -1;
+    if (at == offset)
+        return 0;
+    if (b->len) {
+        if (w->direct && b->len % w->block_size && pad_last_sector(w, b))
+            return -1;
+        if (submit_buffer(w))
+            return -1;
+    }
+    /* Going back over what's been written, zeroes have to be written too */
+    if (offset < at)
+        w->zero_end = 0;
+    /* A sector shared with what came before has to be read after
+     * that's been written */
+    if (w->direct && offset % w->block_size && w->backend->reap(w, 1))
+        return -1;
+    return start_at(w, offset);
+}
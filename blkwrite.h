@@ -0,0 +1,42 @@
+#ifndef __BLKWRITE_H__
+#define __BLKWRITE_H__
+#include <sys/types.h>
+
+/*
+ * Sequential writes to a block device that bypass the page cache.  Data
+ * is gathered into aligned buffers and written with O_DIRECT from a
+ * separate thread while the next buffer fills.  Targets that won't do
+ * O_DIRECT (regular files, some drivers) get buffered writes instead,
+ * with the written pages dropped from the cache after every sync.
+ */
+struct blk_writer;
+
+/* Start writing path at byte offset.  flags are extra open() flags,
+ * such as O_CREAT.  Returns NULL if path can't be opened. */
+struct blk_writer *open_blk_writer(const char *path, int flags, off_t offset);
+
+/* Returns 0, or -1 if this or any earlier write failed */
+int blk_write(struct blk_writer *w, const void *buf, size_t len);
+
+/* Carry on writing at offset instead.  Returns -1 if anything so far
+ * has failed. */
+int blk_seek(struct blk_writer *w, off_t offset);
+
+/* Write out what's left, sync and close.  Returns 0 only if every byte
+ * made it to the device. */
+int close_blk_writer(struct blk_writer *w);
+
+/* From here on, compare each buffer with what's on the device first,
+ * and leave it alone if it's already there */
+void blk_skip_unchanged(struct blk_writer *w);
+
+/*
+ * Before anything's written, clear length bytes from the start offset
+ * (0 for the rest of the device) so the card can program them without
+ * erasing first: a discard, a zero-out, or a hole punched in a file,
+ * as the device and "write_prepare" (auto, discard, zeroout or off)
+ * allow.  Returns 0 if the region now reads back as zeroes, in which
+ * case all-zero buffers written into it are skipped; -1 if not.
+ */
+int blk_prepare(struct blk_writer *w, off_t length);
+#endif /* __BLKWRITE_H__ */
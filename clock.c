@@ -0,0 +1,12 @@
+#include <time.h>
+#include "clock.h"
+
+unsigned long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+unsigned long long monotonic_ms(void) {
+    return monotonic_us() / 1000;
+}
@@ -0,0 +1,11 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+/*
+ * Time since some point before this run, on CLOCK_MONOTONIC, so it
+ * never jumps when the clock is set.  Timeouts, rates, stage timings
+ * and the trace all measure with these, so their numbers line up.
+ */
+unsigned long long monotonic_us(void);
+unsigned long long monotonic_ms(void);
+#endif /* __CLOCK_H__ */
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "config-area.h"
+#include "blkwrite.h"
+#include "ext2.h"
+#include "log.h"
+
+#define BLOCK_TABLE_END     0xffffffff
+#define MAX_BLOCKS          (sizeof(((struct config_area *)0)->block_table) \
+                             / sizeof(struct block_def))
+
+/* Reads from a mounted filesystem are this big */
+#define COPY_SIZE           (1024 * 1024)
+
+static int compare_names(const void *a, const void *b) {
+    const struct block_def *x = *(struct block_def * const *)a;
+    const struct block_def *y = *(struct block_def * const *)b;
+
+    return memcmp(x->n.name, y->n.name, sizeof(x->n.name));
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    const struct block_def *x = *(struct block_def * const *)a;
+    const struct block_def *y = *(struct block_def * const *)b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+int read_config_area(const char *dev, struct config_area_index *index) {
+    struct config_area *ca = &index->ca;
+    struct block_def *sorted[MAX_BLOCKS];
+    ssize_t n;
+    int fd, i;
+
+    fd = open(dev, O_RDONLY);
+    if (-1 == fd) {
+        PERROR("Couldn't open %s", dev);
+        return -1;
+    }
+    n = pread(fd, ca, sizeof(*ca), CONFIG_AREA_PART1_OFFSET);
+    close(fd);
+    if (n != sizeof(*ca)) {
+        PERROR("Couldn't read config area");
+        return -1;
+    }
+
+    if (memcmp(ca->sig, "Cfg*", 4)) {
+        ERROR("Config block doesn't have proper signature "
+              " (Wanted Cfg*, got %c%c%c%c)",
+              ca->sig[0], ca->sig[1], ca->sig[2], ca->sig[3]);
+        return -1;
+    }
+    if (ca->area_version[0] != 1) {
+        ERROR("Config area is version %d.%d.%d.%d, wanted 1.x",
+            ca->area_version[0], ca->area_version[1],
+            ca->area_version[2], ca->area_version[3]);
+        return -1;
+    }
+
+    index->nblocks = 0;
+    for (i = 0; i < MAX_BLOCKS; i++) {
+        struct block_def *bd = &ca->block_table[i];
+
+        if (bd->offset == BLOCK_TABLE_END)
+            break;
+        if (!bd->offset || !bd->length
+         || bd->offset + bd->length < bd->offset) {
+            ERROR("Config block %.4s has a bad extent (%u bytes at %u)",
+                bd->n.name, bd->length, bd->offset);
+            return -1;
+        }
+        index->blocks[index->nblocks++] = bd;
+    }
+
+    /* Blocks mustn't overlap each other */
+    memcpy(sorted, index->blocks, index->nblocks * sizeof(*sorted));
+    qsort(sorted, index->nblocks, sizeof(*sorted), compare_offsets);
+    for (i = 1; i < index->nblocks; i++) {
+        if (sorted[i - 1]->offset + sorted[i - 1]->length > sorted[i]->offset) {
+            ERROR("Config blocks %.4s and %.4s overlap",
+                sorted[i - 1]->n.name, sorted[i]->n.name);
+            return -1;
+        }
+    }
+
+    qsort(index->blocks, index->nblocks, sizeof(*index->blocks),
+          compare_names);
+    for (i = 1; i < index->nblocks; i++) {
+        if (!compare_names(&index->blocks[i - 1], &index->blocks[i])) {
+            ERROR("Config block %.4s appears twice", index->blocks[i]->n.name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct block_def *find_config_block(struct config_area_index *index,
+                                    const char *name) {
+    struct block_def key, *keyp = &key, **found;
+
+    memset(&key, 0, sizeof(key));
+    strncpy(key.n.name, name, sizeof(key.n.name));
+    found = bsearch(&keyp, index->blocks, index->nblocks,
+                    sizeof(*index->blocks), compare_names);
+    return found ? *found : NULL;
+}
+
+
+struct slot_copy {
+    struct blk_writer *out;
+    const char *name;
+    unsigned length;            /* room left in the block */
+};
+
+static int copy_to_slot(void *_copy, const void *buf, size_t len) {
+    struct slot_copy *copy = _copy;
+
+    if (len > copy->length)
+        len = copy->length;
+    if (blk_write(copy->out, buf, len)) {
+        ERROR("Unable to write to %s", copy->name);
+        return -1;
+    }
+    copy->length -= len;
+    return !copy->length;
+}
+
+static int copy_plain_file(const char *file, struct slot_copy *copy) {
+    char *buf;
+    int src, ret = 0;
+
+    src = open(file, O_RDONLY);
+    if (-1 == src) {
+        PERROR("Couldn't open %s", file);
+        return -1;
+    }
+    buf = malloc(COPY_SIZE);
+    if (!buf) {
+        ERROR("Out of memory copying %s", file);
+        close(src);
+        return -1;
+    }
+
+    while (copy->length > 0) {
+        ssize_t rd = read(src, buf, COPY_SIZE);
+        if (rd == -1) {
+            PERROR("Unable to read %s", file);
+            ret = -1;
+            break;
+        }
+        if (!rd)
+            break;
+        if (copy_to_slot(copy, buf, rd) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    free(buf);
+    close(src);
+    return ret;
+}
+
+struct pending_slot {
+    struct config_slot_write *slot;
+    struct block_def *bd;
+};
+
+static int compare_pending(const void *a, const void *b) {
+    const struct pending_slot *x = a, *y = b;
+
+    return x->bd->offset < y->bd->offset ? -1 : x->bd->offset > y->bd->offset;
+}
+
+int write_config_slots(struct config_area_index *index, const char *dev,
+                       struct config_slot_write *slots, int count) {
+    struct pending_slot order[MAX_BLOCKS];
+    struct blk_writer *out = NULL;
+    int i, n = 0, ret = 0;
+
+    for (i = 0; i < count; i++) {
+        struct block_def *bd = find_config_block(index, slots[i].name);
+        slots[i].result = -1;
+        if (!bd) {
+            NOTE("There's no %s block in the config area", slots[i].name);
+            ret = -1;
+            continue;
+        }
+        if (n < MAX_BLOCKS) {
+            order[n].slot = &slots[i];
+            order[n].bd = bd;
+            n++;
+        }
+    }
+    qsort(order, n, sizeof(*order), compare_pending);
+
+    for (i = 0; i < n; i++) {
+        struct config_slot_write *slot = order[i].slot;
+        struct block_def *bd = order[i].bd;
+        struct slot_copy copy;
+
+        NOTE("Writing %s to %s at offset %u, %u bytes long",
+            slot->file, slot->name, bd->offset, bd->length);
+        if (!out) {
+            out = open_blk_writer(dev, 0, bd->offset);
+            if (!out) {
+                ERROR("Couldn't open %s to write %s", dev, slot->name);
+                return -1;
+            }
+            /* Usually the blocks already hold these very files */
+            blk_skip_unchanged(out);
+        }
+        else if (blk_seek(out, bd->offset)) {
+            ret = -1;
+            continue;
+        }
+
+        copy.out = out;
+        copy.name = slot->name;
+        copy.length = bd->length;
+        if (slot->fs_dev)
+            slot->result = read_ext2_file(slot->fs_dev, slot->file,
+                                          copy_to_slot, &copy);
+        else
+            slot->result = copy_plain_file(slot->file, &copy);
+        if (slot->result == EXT2_ABORTED)
+            slot->result = -1;
+
+        if (!slot->result && copy.length)
+            NOTE("Reached the end of %s, with %u bytes of %s left",
+                slot->file, copy.length, slot->name);
+        if (slot->result)
+            ret = -1;
+    }
+
+    /* The one sync for all of them */
+    if (out && close_blk_writer(out)) {
+        ERROR("Unable to write config blocks to %s", dev);
+        for (i = 0; i < n; i++)
+            if (!order[i].slot->result)
+                order[i].slot->result = -1;
+        ret = -1;
+    }
+    return ret;
+}
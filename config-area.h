@@ -91,4 +91,48 @@ struct config_area {
 	unsigned char unused3[0];
 };
 
+
+/*
+ * The config area as read off partition 1, with its block table
+ * checked and sorted by name for lookups.
+ */
+struct config_area_index {
+	struct config_area ca;
+	int nblocks;
+	struct block_def *blocks[64];
+};
+
+/* One block to fill from a file */
+struct config_slot_write {
+	/* Name of the block, e.g. "krnA" */
+	const char *name;
+
+	/* Where its contents come from */
+	const char *file;
+
+	/*
+	 * If set, file is read straight off the ext2 filesystem on this
+	 * device; otherwise it's an ordinary path
+	 */
+	const char *fs_dev;
+
+	/* Set by write_config_slots(): 0, -1, or EXT2_UNREADABLE */
+	int result;
+};
+
+/* Read and check the config area on dev.  Returns 0 or -1. */
+int read_config_area(const char *dev, struct config_area_index *index);
+
+/* NULL if there's no block by that name */
+struct block_def *find_config_block(struct config_area_index *index,
+				    const char *name);
+
+/*
+ * Fill the named blocks on dev in a single pass, in on-disk order, with
+ * one sync at the end.  Blocks that already hold the right data aren't
+ * rewritten.  Returns 0 if every block was written.
+ */
+int write_config_slots(struct config_area_index *index, const char *dev,
+		       struct config_slot_write *slots, int count);
+
 #endif
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "config.h"
+#include "log.h"
+
+struct config_entry {
+    struct config_entry *next;
+    char *key;
+    char *value;
+};
+
+static const char *config_path = RECOVERY_CONFIG_FILE;
+static struct config_entry *entries;
+static int loaded;
+
+static char *strip(char *s) {
+    char *end;
+
+    while (isspace((unsigned char)*s))
+        s++;
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return s;
+}
+
+/*
+ * What's safe to log of a setting: passphrases not at all, and URLs
+ * and proxies ("user:pass@host") without their credentials.
+ */
+static void log_entry(const struct config_entry *e) {
+    const char *host = strstr(e->value, "://");
+    const char *at;
+    size_t len = strlen(e->key);
+
+    if (len >= 3 && !strcmp(e->key + len - 3, "psk")) {
+        NOTE("Config: %s = (hidden)", e->key);
+        return;
+    }
+    host = host ? host + 3 : e->value;
+    at = strchr(host, '@');
+    if (at && at < host + strcspn(host, "/"))
+        NOTE("Config: %s = %.*s***%s", e->key, (int)(host - e->value),
+            e->value, at);
+    else
+        NOTE("Config: %s = %s", e->key, e->value);
+}
+
+static void free_config(void) {
+    while (entries) {
+        struct config_entry *e = entries;
+        entries = e->next;
+        free(e->key);
+        free(e->value);
+        free(e);
+    }
+    loaded = 0;
+}
+
+static void load_config(void) {
+    char line[512];
+    FILE *cfg;
+    int lineno = 0;
+
+    loaded = 1;
+    cfg = fopen(config_path, "r");
+    if (!cfg) {
+        if (errno != ENOENT)
+            PERROR("Unable to open %s", config_path);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), cfg)) {
+        struct config_entry *e;
+        char *key, *value, *p;
+
+        lineno++;
+        /* A comment starts a line or follows a space, so a passphrase
+         * or URL can still have '#' in it */
+        for (p = line; (p = strchr(p, '#')); p++)
+            if (p == line || isspace((unsigned char)p[-1])) {
+                *p = '\0';
+                break;
+            }
+        key = strip(line);
+        if (!*key)
+            continue;
+        value = strchr(key, '=');
+        if (!value) {
+            ERROR("%s:%d: expected key = value", config_path, lineno);
+            continue;
+        }
+        *value++ = '\0';
+        key = strip(key);
+        value = strip(value);
+
+        e = malloc(sizeof(*e));
+        if (!e)
+            break;
+        e->key = strdup(key);
+        e->value = strdup(value);
+        e->next = entries;
+        entries = e;
+        log_entry(e);
+    }
+    fclose(cfg);
+}
+
+const char *config_get(const char *key) {
+    struct config_entry *e;
+
+    if (!loaded)
+        load_config();
+
+    /* Entries are stored newest first, so a later line wins */
+    for (e = entries; e; e = e->next)
+        if (!strcmp(e->key, key))
+            return e->value;
+    return NULL;
+}
+
+void config_set(const char *key, const char *value) {
+    struct config_entry *e;
+
+    if (!loaded)
+        load_config();
+    e = malloc(sizeof(*e));
+    if (!e)
+        return;
+    e->key = strdup(key);
+    e->value = strdup(value);
+    e->next = entries;
+    entries = e;
+}
+
+void set_config_file(const char *path) {
+    free_config();
+    config_path = path;
+}
@@ -0,0 +1,16 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+/* Site settings, one "key = value" per line.  '#' at the start of a
+ * line or after a space starts a comment. */
+#define RECOVERY_CONFIG_FILE "/etc/recovery.conf"
+
+/* Returns the value for key, or NULL if it isn't set */
+const char *config_get(const char *key);
+
+/* Override key until the config file is changed */
+void config_set(const char *key, const char *value);
+
+/* Read settings from path instead of RECOVERY_CONFIG_FILE */
+void set_config_file(const char *path);
+#endif /* __CONFIG_H__ */
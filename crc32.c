@@ -0,0 +1,26 @@
+#include <pthread.h>
+#include "crc32.h"
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table(void) {
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        for (c = i, j = 0; j < 8; j++)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t c = crc ^ 0xffffffff;
+
+    pthread_once(&crc_once, make_crc_table);
+    while (len--)
+        c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffff;
+}
@@ -0,0 +1,9 @@
+#ifndef __CRC32_H__
+#define __CRC32_H__
+#include <stdint.h>
+#include <stddef.h>
+
+/* The CRC-32 gzip uses.  Start with crc 0, and pass the last result
+ * back in to carry on over data that comes in pieces. */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+#endif /* __CRC32_H__ */
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE /* strtok_r */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "blkwrite.h"
+#include "delta.h"
+#include "sha256.h"
+#include "trace.h"
+#include "wget.h"
+#include "log.h"
+
+/* Blocks the manifest may use */
+#define MIN_BLOCK_SIZE  4096
+#define MAX_BLOCK_SIZE  (1024 * 1024)
+
+/* How much of dev is read and checked at once */
+#define CHECK_SIZE      (1024 * 1024)
+
+/* Past this share of the image, the gzipped download is cheaper than
+ * fetching the differences uncompressed */
+#define MAX_DELTA_PERCENT 30
+
+/* A run of differing blocks being fetched and written */
+struct fetch_state {
+    struct delta *m;
+    const char *dev;
+    struct blk_writer *out;
+    unsigned char *block;
+    off_t block_start;
+    unsigned fill;
+    off_t next_write;       /* where out would write next */
+    off_t done, total;
+    int (*upd)(void *, off_t, off_t);
+    void *dat;
+};
+
+/* rsync's checksum.  The manifest's blocks line up with dev's, so it
+ * never has to roll; it just keeps SHA-256 off most damaged blocks. */
+static uint32_t weak_sum(const unsigned char *p, size_t len) {
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        a += p[i];
+        b += (len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+static int parse_hex(const char *s, unsigned char *out, int len) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        unsigned v;
+        if (sscanf(s + 2 * i, "%2x", &v) != 1)
+            return -1;
+        out[i] = v;
+    }
+    return s[2 * len] && s[2 * len] != ' ' ? -1 : 0;
+}
+
+void close_delta(struct delta *m) {
+    free(m->weak);
+    free(m->strong);
+    free(m->differs);
+    m->weak = NULL;
+    m->strong = NULL;
+    m->differs = NULL;
+}
+
+static int parse_manifest(char *text, const char *manifest_url,
+                          struct delta *m) {
+    char *line, *save, *value;
+    int n = 0;
+
+    for (line = strtok_r(text, "\r\n", &save); line;
+         line = strtok_r(NULL, "\r\n", &save)) {
+        if (line[0] == '#' || !line[0])
+            continue;
+        value = strchr(line, ' ');
+        if (!value)
+            break;
+        *value++ = '\0';
+
+        if (!strcmp(line, "url")) {
+            const char *slash = strrchr(manifest_url, '/');
+            if (strstr(value, "://") || !slash)
+                snprintf(m->url, sizeof(m->url), "%s", value);
+            else
+                snprintf(m->url, sizeof(m->url), "%.*s%s",
+                         (int)(slash + 1 - manifest_url), manifest_url, value);
+        }
+        else if (!strcmp(line, "length"))
+            m->length = strtoll(value, NULL, 10);
+        else if (!strcmp(line, "blocksize"))
+            m->blocksize = strtoul(value, NULL, 10);
+        else if (!strcmp(line, "version"))
+            snprintf(m->version, sizeof(m->version), "%s", value);
+        else if (!strcmp(line, "slot")) {
+            /* "slot krnA length sha256": what a config-area block holds */
+            struct delta_slot *slot = &m->slots[m->nslots];
+            char *hash;
+            if (m->nslots >= DELTA_MAX_SLOTS)
+                continue;
+            snprintf(slot->name, sizeof(slot->name), "%.4s", value);
+            slot->length = strtoll(value + strcspn(value, " "), &hash, 10);
+            if (slot->length <= 0 || *hash++ != ' '
+             || parse_hex(hash, slot->sha256, SHA256_DIGEST_SIZE)) {
+                ERROR("Manifest line for slot %s is bad", slot->name);
+                return -1;
+            }
+            m->nslots++;
+        }
+        else {
+            if (!m->weak) {
+                if (m->length <= 0 || m->blocksize < MIN_BLOCK_SIZE
+                 || m->blocksize > MAX_BLOCK_SIZE || m->blocksize & 511) {
+                    ERROR("Manifest has a bad length or block size");
+                    return -1;
+                }
+                m->nblocks = (m->length + m->blocksize - 1) / m->blocksize;
+                m->weak = malloc(m->nblocks * sizeof(*m->weak));
+                m->strong = malloc(m->nblocks * sizeof(*m->strong));
+                if (!m->weak || !m->strong) {
+                    ERROR("Out of memory for %d blocks", m->nblocks);
+                    return -1;
+                }
+            }
+            value[-1] = ' ';
+            if (n >= m->nblocks || sscanf(line, "%8x", &m->weak[n]) != 1
+             || parse_hex(value, m->strong[n], SHA256_DIGEST_SIZE)) {
+                ERROR("Manifest line for block %d is bad", n);
+                return -1;
+            }
+            n++;
+        }
+    }
+
+    if (!m->url[0] || !m->weak || n != m->nblocks) {
+        ERROR("Manifest is incomplete (%d of %d blocks)", n, m->nblocks);
+        return -1;
+    }
+    return 0;
+}
+
+int open_delta(struct delta *m, const char *url) {
+    struct wget_fetch f;
+    int ret;
+
+    bzero(m, sizeof(*m));
+    f.url = (char *)url;
+    if (fetch_wget(&f) || !f.data) {
+        NOTE("No delta manifest at %s", url);
+        return -1;
+    }
+    ret = parse_manifest(f.data, url, m);
+    free(f.data);
+    if (ret)
+        close_delta(m);
+    else
+        NOTE("Delta manifest: %s, %lld bytes in %d blocks of %u", m->url,
+            (long long)m->length, m->nblocks, m->blocksize);
+    return ret;
+}
+
+int check_delta(struct delta *m, const char *dev,
+                int (*upd)(void *, off_t, off_t), void *dat) {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    unsigned char *buf;
+    off_t offset, bad = 0, limit = m->length / 100 * MAX_DELTA_PERCENT;
+    size_t chunk;
+    int fd, i;
+
+    fd = open(dev, O_RDONLY);
+    if (fd == -1) {
+        PERROR("Unable to open %s", dev);
+        return -1;
+    }
+    chunk = CHECK_SIZE / m->blocksize * m->blocksize;
+    if (chunk < m->blocksize)
+        chunk = m->blocksize;
+    free(m->differs);
+    m->differs = malloc(m->nblocks);
+    buf = malloc(chunk);
+    if (!buf || !m->differs) {
+        ERROR("Out of memory checking %s", dev);
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, m->length, POSIX_FADV_SEQUENTIAL);
+
+    i = 0;
+    for (offset = 0; offset < m->length; offset += chunk) {
+        ssize_t got = pread(fd, buf, chunk, offset);
+        ssize_t pos;
+
+        if (got < 0) {
+            /* Unreadable blocks are exactly the ones to replace */
+            PERROR("Unable to read %s at %lld", dev, (long long)offset);
+            got = 0;
+        }
+        posix_fadvise(fd, offset, chunk, POSIX_FADV_DONTNEED);
+
+        for (pos = 0; pos < (ssize_t)chunk && i < m->nblocks;
+             pos += m->blocksize, i++) {
+            size_t len = m->length - offset - pos < m->blocksize
+                       ? m->length - offset - pos : m->blocksize;
+
+            m->differs[i] = pos + (ssize_t)len > got
+                         || weak_sum(buf + pos, len) != m->weak[i];
+            if (!m->differs[i]) {
+                sha256(buf + pos, len, digest);
+                m->differs[i] = !!memcmp(digest, m->strong[i], sizeof(digest));
+            }
+            if (m->differs[i])
+                bad += len;
+        }
+        if (upd && upd(dat, offset + chunk < m->length ? offset + chunk
+                                                       : m->length,
+                       m->length)) {
+            bad = -1;
+            break;
+        }
+
+        /* It's going to be written whole, so the rest needn't be read */
+        if (bad > limit) {
+            memset(m->differs + i, 1, m->nblocks - i);
+            break;
+        }
+    }
+
+    free(buf);
+    close(fd);
+    m->bad = bad;
+    if (bad < 0)
+        return -1;
+    if (bad > limit)
+        NOTE("Over %d%% of %s differs from the image, not checking the rest",
+            MAX_DELTA_PERCENT, dev);
+    else if (bad)
+        NOTE("%lld of %lld bytes of %s differ from the image",
+            (long long)bad, (long long)m->length, dev);
+    else
+        NOTE("%s already matches the image", dev);
+    return 0;
+}
+
+static int put_block_data(void *_st, off_t offset, const void *buf, size_t len) {
+    struct fetch_state *st = _st;
+    struct delta *m = st->m;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+
+    while (len) {
+        unsigned block_len;
+        size_t n;
+        int i;
+
+        if (!st->fill)
+            st->block_start = offset;
+        if (offset != st->block_start + st->fill
+         || st->block_start % m->blocksize) {
+            ERROR("Range data at %lld isn't where it should be",
+                  (long long)offset);
+            return -1;
+        }
+        i = st->block_start / m->blocksize;
+        block_len = m->length - st->block_start < m->blocksize
+                  ? m->length - st->block_start : m->blocksize;
+
+        n = block_len - st->fill;
+        if (n > len)
+            n = len;
+        memcpy(st->block + st->fill, buf, n);
+        st->fill += n;
+        offset += n;
+        buf = (const char *)buf + n;
+        len -= n;
+        if (st->fill < block_len)
+            continue;
+
+        /* Only blocks that are what the manifest says go on the card */
+        sha256(st->block, block_len, digest);
+        if (memcmp(digest, m->strong[i], sizeof(digest))) {
+            ERROR("Block %d of %s doesn't match the manifest", i, m->url);
+            return -1;
+        }
+        if (!st->out) {
+            st->out = open_blk_writer(st->dev, 0, st->block_start);
+            if (!st->out) {
+                ERROR("Unable to open %s", st->dev);
+                return -1;
+            }
+        }
+        else if (st->block_start != st->next_write
+              && blk_seek(st->out, st->block_start))
+            return -1;
+        if (blk_write(st->out, st->block, block_len))
+            return -1;
+        st->next_write = st->block_start + block_len;
+        st->fill = 0;
+
+        st->done += block_len;
+        if (st->upd && st->upd(st->dat, st->done, st->total))
+            return -1;
+    }
+    return 0;
+}
+
+int apply_delta(struct delta *m, const char *dev,
+                int (*upd)(void *, off_t, off_t), void *dat) {
+    struct fetch_state st;
+    struct wget_range *ranges;
+    off_t bad = m->bad;
+    int nranges = 0, ret = -1, i;
+
+    if (!bad)
+        return 0;
+    if (bad > m->length / 100 * MAX_DELTA_PERCENT) {
+        NOTE("Too much differs to fetch piecemeal");
+        return -1;
+    }
+
+    /* Neighbouring bad blocks are fetched together */
+    ranges = malloc(m->nblocks * sizeof(*ranges));
+    if (!ranges) {
+        ERROR("Out of memory for %d ranges", m->nblocks);
+        return -1;
+    }
+    for (i = 0; i < m->nblocks; i++) {
+        off_t start = (off_t)i * m->blocksize;
+        off_t len = m->length - start < m->blocksize ? m->length - start
+                                                     : m->blocksize;
+        if (!m->differs[i])
+            continue;
+        if (nranges && ranges[nranges - 1].start
+                       + ranges[nranges - 1].length == start)
+            ranges[nranges - 1].length += len;
+        else {
+            ranges[nranges].start = start;
+            ranges[nranges].length = len;
+            nranges++;
+        }
+    }
+    NOTE("Fetching %lld bytes in %d ranges from %s",
+        (long long)bad, nranges, m->url);
+
+    bzero(&st, sizeof(st));
+    st.m = m;
+    st.dev = dev;
+    st.done = m->length;
+    st.total = m->length + bad;
+    st.upd = upd;
+    st.dat = dat;
+    st.block = malloc(m->blocksize);
+    if (!st.block) {
+        ERROR("Out of memory for a %u byte block", m->blocksize);
+        free(ranges);
+        return -1;
+    }
+    trace_begin("flash", "apply_delta");
+    ret = fetch_wget_ranges(m->url, ranges, nranges, put_block_data, &st);
+    if (st.out && close_blk_writer(st.out))
+        ret = -1;
+    trace_end("flash", "apply_delta");
+    if (!ret && st.done != st.total) {
+        ERROR("Only fetched %lld of %lld bytes",
+            (long long)(st.done - m->length), (long long)bad);
+        ret = -1;
+    }
+    free(st.block);
+    if (!ret)
+        NOTE("Brought %s up to date by fetching %lld bytes", dev,
+            (long long)bad);
+
+    free(ranges);
+    return ret;
+}
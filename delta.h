@@ -0,0 +1,64 @@
+#ifndef __DELTA_H__
+#define __DELTA_H__
+#include <stdint.h>
+#include <sys/types.h>
+#include "sha256.h"
+
+/*
+ * Bring a partition up to date with a published image by fetching only
+ * the blocks that differ, with HTTP Range requests.  The manifest
+ * describes the uncompressed image, block by block:
+ *
+ *     url disk-image.img
+ *     length 512000000
+ *     blocksize 65536
+ *     version 1.7.1892
+ *     slot krnA 2301904 5feceb66ffc86f38d952786c6d696c79c2dbc239dd4e91b46729d73a27fb57e9
+ *     0a1b2c3d 9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08
+ *     ...
+ *
+ * The url may be relative to the manifest's.  The optional version and
+ * slot lines say what the image calls itself, and what each config-area
+ * block should start with once it's restored.  Each block of the image
+ * gets a line with its rsync-style weak checksum and its SHA-256, in hex.
+ */
+#define DELTA_MAX_SLOTS 4
+
+struct delta_slot {
+    char name[5];
+    off_t length;
+    unsigned char sha256[SHA256_DIGEST_SIZE];
+};
+
+struct delta {
+    char url[512];          /* of the uncompressed image */
+    off_t length;
+    unsigned blocksize;
+    int nblocks;
+    uint32_t *weak;
+    unsigned char (*strong)[SHA256_DIGEST_SIZE];
+    char version[16];       /* empty if the manifest doesn't say */
+    struct delta_slot slots[DELTA_MAX_SLOTS];
+    int nslots;
+
+    /* From check_delta() */
+    char *differs;          /* per block */
+    off_t bad;              /* bytes in the blocks that differ */
+};
+
+/* Fetch and parse the manifest.  Returns 0 or -1. */
+int open_delta(struct delta *d, const char *manifest_url);
+
+/* Read dev and find the blocks that differ.  upd() hears how much has
+ * been checked.  Stops early, with the rest counted as differing, once
+ * too much differs for apply_delta() to fetch.  Returns 0 or -1. */
+int check_delta(struct delta *d, const char *dev,
+                int (*upd)(void *, off_t done, off_t total), void *dat);
+
+/* Fetch and write the blocks check_delta() found.  Returns 0 if dev now
+ * holds the image, or -1 if it should be written out in full instead. */
+int apply_delta(struct delta *d, const char *dev,
+                int (*upd)(void *, off_t done, off_t total), void *dat);
+
+void close_delta(struct delta *d);
+#endif /* __DELTA_H__ */
@@ -53,6 +53,8 @@
 #include <linux/route.h>
 
 #include "log.h"
+#include "dhcpc.h"
+#include "trace.h"
 
 #ifndef offsetof
 # define offsetof(T,F) ((unsigned int)((char *)&((T *)0L)->F - (char *)0L))
@@ -347,7 +349,7 @@ const struct dhcp_optflag dhcp_optflags[] = {
 #endif  
         { OPTION_STATIC_ROUTES                    , 0x79 }, /* DHCP_STATIC_ROUTES */
         { OPTION_STATIC_ROUTES                    , 0xf9 }, /* DHCP_MS_STATIC_ROUTES */
-        { OPTION_STRING                           , 0xfc }, /* DHCP_WPAD          */
+        { OPTION_STRING               | OPTION_REQ, 0xfc }, /* DHCP_WPAD          */
 
         /* Options below have no match in dhcp_option_strings[],
          * are not passed to dhcpc scripts, and cannot be specified
@@ -419,19 +421,24 @@ static inline void fill_addr(struct sockaddr_in *in, void *addr) {
 
 #define mask_in_addr(x) (((struct sockaddr_in *)&((x).rt_genmask))->sin_addr.s_addr)
 static inline void populate_resolv_conf(FILE *resolv, void *data) {
-	int addr_count = 0;
-/* Only support one nameserver for now */
-//	while (addr_count < 5 && ((char *)data)[0] != '\r') {
-		addr_count++;
-		const uint8_t *ip = data;
+	const uint8_t *ip = data;
+	int len;
+
+	if (!ip) {
+		ERROR("Server didn't give us any nameservers");
+		return;
+	}
+
+	/* Write every server, so the resolver can query them in parallel */
+	len = ip[OPT_LEN - OPT_DATA];
+	while (len >= 4) {
 		NOTE("Adding nameserver %u.%u.%u.%u",
 			ip[0], ip[1], ip[2], ip[3]);
 		fprintf(resolv, "nameserver %u.%u.%u.%u\n",
 			ip[0], ip[1], ip[2], ip[3]);
-		data += 4;
-//		if ( ((char *)data)[0] == '\f')
-//			data++;
-//	}
+		ip += 4;
+		len -= 4;
+	}
 }
 
 
@@ -562,6 +569,31 @@ static inline int set_resolv_conf(struct client_config_t *cfg,
 }
 
 
+/* Leave the proxy autoconfig URL where wget can find it.  No WPAD
+ * option means no proxy, so clear out any earlier lease's. */
+static inline int set_wpad(struct client_config_t *cfg,
+			   struct dhcp_packet *packet)
+{
+	const uint8_t *url = udhcp_get_option(packet, DHCP_WPAD);
+	FILE *wpad;
+
+	if (!url) {
+		unlink(WPAD_URL_FILE);
+		return 0;
+	}
+
+	wpad = fopen(WPAD_URL_FILE, "w");
+	if (!wpad) {
+		PERROR("Unable to create %s", WPAD_URL_FILE);
+		return -1;
+	}
+	NOTE("Proxy autoconfig at %.*s", url[OPT_LEN - OPT_DATA], url);
+	fprintf(wpad, "%.*s\n", url[OPT_LEN - OPT_DATA], url);
+	fclose(wpad);
+	return 0;
+}
+
+
 static void udhcp_run_script(struct client_config_t *cfg, struct dhcp_packet *packet, const char *name)
 {
 	if (!strcmp(name, "bound")) {
@@ -575,6 +607,8 @@ static void udhcp_run_script(struct client_config_t *cfg, struct dhcp_packet *pa
 
 		if (set_resolv_conf(cfg, packet))
 			return;
+
+		set_wpad(cfg, packet);
 	}
 	else
 		NOTE("Need to handle script %s", name);
@@ -1551,6 +1585,7 @@ int udhcpc_main(char *interface)
 	struct dhcp_packet packet;
 	fd_set rfds;
 	int pid = 0;
+	int tracing = 1; /* until the first lease */
 
 	bzero(&client_config, sizeof(client_config));
 
@@ -1558,11 +1593,13 @@ int udhcpc_main(char *interface)
 	client_config.interface = interface;
 	client_config.hostname = alloc_dhcp_option(DHCP_HOST_NAME, "NeTV-Recovery", 0);
 
+	trace_begin("net", "udhcpc");
 	if (udhcp_read_interface(client_config.interface,
 			&client_config.ifindex,
 			NULL,
 			client_config.client_mac)
 	) {
+		trace_end("net", "udhcpc");
 		return 1;
 	}
 
@@ -1630,6 +1667,8 @@ int udhcpc_main(char *interface)
 					NULL,
 					client_config.client_mac)
 			) {
+				if (tracing)
+					trace_end("net", "udhcpc");
 				return 1; /* iface is gone? */
 			}
 
@@ -1843,8 +1882,12 @@ int udhcpc_main(char *interface)
 
 				state = BOUND;
 				change_listen_mode(&client_config, LISTEN_NONE);
+				if (tracing)
+					trace_end("net", "udhcpc");
+				tracing = 0;
 				if ((pid=client_background()))
 					return pid;
+				trace_process_name("udhcpc");
 				/* do not background again! */
 				already_waited_sec = 0;
 				continue; /* back to main loop */
@@ -1873,6 +1916,8 @@ int udhcpc_main(char *interface)
  ret0:
 	retval = 0;
  ret:
+	if (tracing)
+		trace_end("net", "udhcpc");
 	return retval;
 }
 
@@ -1,4 +1,8 @@
 #ifndef __DHCPC_H__
 #define __DHCPC_H__
+
+/* Proxy autoconfig URL from the lease's WPAD option, if it had one */
+#define WPAD_URL_FILE "/etc/wpad.url"
+
 int udhcpc_main(char *interface);
 #endif /* __DHCPC_H__ */
@@ -0,0 +1,572 @@
+/*
+ * Minimal caching DNS stub resolver.
+ *
+ * Looks up A and AAAA records over UDP, sending every query to every
+ * nameserver in resolv.conf at once and taking the first usable answer.
+ * Answers are cached for as long as their TTL allows, so redirects and
+ * retries to the same host don't go back out over the air.  Everything
+ * is non-blocking: callers poll the query's sockets alongside their own
+ * and call poll_dns() when something happens.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dns.h"
+#include "log.h"
+#include "clock.h"
+
+#define RESOLV_CONF "/etc/resolv.conf"
+#define DNS_PORT 53
+#define MAX_SERVERS 3
+#define CACHE_SIZE 16
+
+/* Resend unanswered queries this often, and give up after */
+#define RETRY_MS 1000
+#define TIMEOUT_MS 5000
+
+#define TYPE_A 1
+#define TYPE_CNAME 5
+#define TYPE_AAAA 28
+#define CLASS_IN 1
+
+#define FLAG_QR 0x8000
+#define FLAG_TC 0x0200
+#define FLAG_RD 0x0100
+#define RCODE_NXDOMAIN 3
+
+struct dns_server {
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in sin;
+        struct sockaddr_in6 sin6;
+    } u;
+    socklen_t len;
+};
+
+struct cache_entry {
+    char name[256];
+    unsigned long long expires;
+    int count;
+    struct dns_addr addrs[DNS_MAX_ADDRS];
+};
+
+/* One of the two record types we ask for */
+struct lookup {
+    int type;
+    uint16_t id;
+    int done;
+    int count;
+    uint32_t ttl;
+    struct dns_addr addrs[DNS_MAX_ADDRS];
+};
+
+struct dns_query {
+    char name[256];
+    int fd[2];                  /* IPv4 and IPv6 sockets, or -1 */
+    struct lookup lookup[2];    /* A, AAAA */
+    unsigned long long next_send;
+    unsigned long long deadline;
+    int cached;
+    struct cache_entry *entry;
+};
+
+static const char *resolv_conf = RESOLV_CONF;
+static time_t resolv_mtime;
+static struct dns_server servers[MAX_SERVERS];
+static int server_count;
+static struct cache_entry cache[CACHE_SIZE];
+
+static uint16_t random_id(void)
+{
+    uint16_t id;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1 || read(fd, &id, sizeof(id)) != sizeof(id))
+        id = rand() ^ getpid() ^ monotonic_ms();
+    if (fd != -1)
+        close(fd);
+    return id;
+}
+
+void set_dns_config(const char *path)
+{
+    resolv_conf = path;
+    resolv_mtime = 0;
+    server_count = 0;
+}
+
+/*
+ * (Re)read the nameserver list whenever resolv.conf changes, e.g. after
+ * a DHCP renewal.  As an extension, "nameserver 127.0.0.1#5353" picks a
+ * port other than 53, which is handy for pointing at a test server.
+ */
+static int load_servers(void)
+{
+    struct stat st;
+    char line[256];
+    FILE *f;
+
+    if (stat(resolv_conf, &st) == -1) {
+        server_count = 0;
+        return 0;
+    }
+    if (server_count && st.st_mtime == resolv_mtime)
+        return server_count;
+
+    f = fopen(resolv_conf, "r");
+    if (!f) {
+        PERROR("Unable to open %s", resolv_conf);
+        return 0;
+    }
+    resolv_mtime = st.st_mtime;
+    server_count = 0;
+
+    while (server_count < MAX_SERVERS && fgets(line, sizeof(line), f)) {
+        struct dns_server *s = &servers[server_count];
+        char addr[64];
+        char *port;
+        int portnum = DNS_PORT;
+
+        if (sscanf(line, "nameserver %63s", addr) != 1)
+            continue;
+        port = strchr(addr, '#');
+        if (port) {
+            *port++ = '\0';
+            portnum = atoi(port);
+        }
+
+        bzero(s, sizeof(*s));
+        if (inet_pton(AF_INET, addr, &s->u.sin.sin_addr) > 0) {
+            s->u.sin.sin_family = AF_INET;
+            s->u.sin.sin_port = htons(portnum);
+            s->len = sizeof(s->u.sin);
+        }
+        else if (inet_pton(AF_INET6, addr, &s->u.sin6.sin6_addr) > 0) {
+            s->u.sin6.sin6_family = AF_INET6;
+            s->u.sin6.sin6_port = htons(portnum);
+            s->len = sizeof(s->u.sin6);
+        }
+        else {
+            ERROR("Ignoring bad nameserver %s", addr);
+            continue;
+        }
+        server_count++;
+    }
+    fclose(f);
+
+    return server_count;
+}
+
+static struct cache_entry *cache_find(const char *name)
+{
+    unsigned long long now = monotonic_ms();
+    int i;
+
+    for (i = 0; i < CACHE_SIZE; i++)
+        if (cache[i].count && cache[i].expires > now
+         && !strcasecmp(cache[i].name, name))
+            return &cache[i];
+    return NULL;
+}
+
+static void cache_store(struct dns_query *q)
+{
+    struct cache_entry *e = NULL;
+    uint32_t ttl = 0;
+    int i;
+
+    for (i = 0; i < 2; i++)
+        if (q->lookup[i].count && (!ttl || q->lookup[i].ttl < ttl))
+            ttl = q->lookup[i].ttl;
+    if (!ttl)
+        return;
+
+    /* Refresh the entry for this name, or evict whichever expires first */
+    for (i = 0; i < CACHE_SIZE && !e; i++)
+        if (!strcasecmp(cache[i].name, q->name))
+            e = &cache[i];
+    if (!e) {
+        e = &cache[0];
+        for (i = 1; i < CACHE_SIZE; i++)
+            if (cache[i].expires < e->expires)
+                e = &cache[i];
+    }
+
+    strcpy(e->name, q->name);
+    e->count = dns_addrs(q, e->addrs, DNS_MAX_ADDRS);
+    e->expires = monotonic_ms() + ttl * 1000ULL;
+    NOTE("Caching %d addresses for %s for %us", e->count, q->name, ttl);
+}
+
+static int build_query(unsigned char *pkt, const char *name, int type, uint16_t id)
+{
+    unsigned char *p = pkt + 12;
+    const char *label = name;
+
+    bzero(pkt, 12);
+    pkt[0] = id >> 8;
+    pkt[1] = id;
+    pkt[2] = FLAG_RD >> 8;
+    pkt[5] = 1;                 /* qdcount */
+
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        int len = dot ? dot - label : (int)strlen(label);
+        if (len < 1 || len > 63 || (p - pkt) + len + 6 > 12 + 255)
+            return -1;
+        *p++ = len;
+        memcpy(p, label, len);
+        p += len;
+        label += len;
+        if (*label == '.')
+            label++;
+    }
+    *p++ = 0;
+    *p++ = type >> 8;
+    *p++ = type;
+    *p++ = CLASS_IN >> 8;
+    *p++ = CLASS_IN;
+    return p - pkt;
+}
+
+/* Expand a possibly-compressed name at off into out (dotted, no trailing
+ * dot).  Returns the offset just past the name as it appears at off. */
+static int decode_name(const unsigned char *msg, int len, int off,
+                       char *out, int outsize)
+{
+    int end = -1;
+    int hops = 0;
+    int n = 0;
+
+    while (1) {
+        int l;
+
+        if (off >= len)
+            return -1;
+        l = msg[off];
+        if ((l & 0xc0) == 0xc0) {
+            if (off + 1 >= len || ++hops > 16)
+                return -1;
+            if (end < 0)
+                end = off + 2;
+            off = ((l & 0x3f) << 8) | msg[off + 1];
+            continue;
+        }
+        if (l & 0xc0)
+            return -1;
+        off++;
+        if (!l)
+            break;
+        if (off + l > len || n + l + 2 > outsize)
+            return -1;
+        if (n)
+            out[n++] = '.';
+        memcpy(out + n, msg + off, l);
+        n += l;
+        off += l;
+    }
+    out[n] = '\0';
+    return end < 0 ? off : end;
+}
+
+static void add_addr(struct lookup *l, const unsigned char *rdata, uint32_t ttl)
+{
+    struct dns_addr *a;
+
+    if (l->count >= DNS_MAX_ADDRS)
+        return;
+    a = &l->addrs[l->count++];
+    bzero(a, sizeof(*a));
+    if (l->type == TYPE_A) {
+        a->family = AF_INET;
+        memcpy(&a->u.v4, rdata, 4);
+    }
+    else {
+        a->family = AF_INET6;
+        memcpy(&a->u.v6, rdata, 16);
+    }
+    if (l->count == 1 || ttl < l->ttl)
+        l->ttl = ttl;
+}
+
+static void parse_response(struct dns_query *q, const unsigned char *msg, int len)
+{
+    struct lookup *l = NULL;
+    char owner[256];
+    char cur[256];
+    int flags, qdcount, ancount;
+    int off, i;
+    uint16_t id;
+
+    if (len < 12)
+        return;
+    id = (msg[0] << 8) | msg[1];
+    for (i = 0; i < 2; i++)
+        if (!q->lookup[i].done && q->lookup[i].id == id)
+            l = &q->lookup[i];
+    if (!l)
+        return;
+
+    flags = (msg[2] << 8) | msg[3];
+    qdcount = (msg[4] << 8) | msg[5];
+    ancount = (msg[6] << 8) | msg[7];
+    if (!(flags & FLAG_QR) || (flags & FLAG_TC) || qdcount != 1)
+        return;
+
+    /* Make sure it's an answer to the question we asked */
+    off = decode_name(msg, len, 12, cur, sizeof(cur));
+    if (off < 0 || off + 4 > len || strcasecmp(cur, q->name))
+        return;
+    if (((msg[off] << 8) | msg[off + 1]) != l->type)
+        return;
+    off += 4;
+
+    if ((flags & 0xf) == RCODE_NXDOMAIN) {
+        l->done = 1;
+        return;
+    }
+    if (flags & 0xf)
+        /* SERVFAIL and friends: hope another server does better */
+        return;
+
+    /* Follow the CNAME chain from the name we asked for */
+    for (i = 0; i < ancount; i++) {
+        int type, class, rdlen;
+        uint32_t ttl;
+
+        off = decode_name(msg, len, off, owner, sizeof(owner));
+        if (off < 0 || off + 10 > len)
+            break;
+        type = (msg[off] << 8) | msg[off + 1];
+        class = (msg[off + 2] << 8) | msg[off + 3];
+        ttl = ((uint32_t)msg[off + 4] << 24) | (msg[off + 5] << 16)
+            | (msg[off + 6] << 8) | msg[off + 7];
+        rdlen = (msg[off + 8] << 8) | msg[off + 9];
+        off += 10;
+        if (off + rdlen > len)
+            break;
+
+        if (class == CLASS_IN && !strcasecmp(owner, cur)) {
+            if (type == TYPE_CNAME)
+                decode_name(msg, len, off, cur, sizeof(cur));
+            else if (type == l->type && rdlen == (type == TYPE_A ? 4 : 16))
+                add_addr(l, msg + off, ttl);
+        }
+        off += rdlen;
+    }
+    l->done = 1;
+}
+
+static void send_queries(struct dns_query *q)
+{
+    int i, s;
+
+    for (i = 0; i < 2; i++) {
+        unsigned char pkt[512];
+        int len;
+
+        if (q->lookup[i].done)
+            continue;
+        len = build_query(pkt, q->name, q->lookup[i].type, q->lookup[i].id);
+        if (len < 0) {
+            ERROR("Can't look up bad name %s", q->name);
+            q->lookup[i].done = 1;
+            continue;
+        }
+        for (s = 0; s < server_count; s++) {
+            int fd = q->fd[servers[s].u.sa.sa_family == AF_INET6];
+            if (fd == -1)
+                continue;
+            if (sendto(fd, pkt, len, 0, &servers[s].u.sa, servers[s].len) < 0)
+                PERROR("Unable to send DNS query");
+        }
+    }
+}
+
+struct dns_query *start_dns(const char *name)
+{
+    struct dns_query *q;
+    int i;
+
+    if (strlen(name) >= sizeof(q->name))
+        return NULL;
+
+    q = malloc(sizeof(*q));
+    if (!q)
+        return NULL;
+    bzero(q, sizeof(*q));
+    strcpy(q->name, name);
+    q->fd[0] = q->fd[1] = -1;
+
+    q->entry = cache_find(name);
+    if (q->entry) {
+        q->cached = 1;
+        return q;
+    }
+
+    if (!load_servers()) {
+        free(q);
+        return NULL;
+    }
+
+    for (i = 0; i < server_count; i++) {
+        int v6 = servers[i].u.sa.sa_family == AF_INET6;
+        if (q->fd[v6] != -1)
+            continue;
+        q->fd[v6] = socket(v6 ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
+        if (q->fd[v6] == -1) {
+            PERROR("Unable to create DNS socket");
+            continue;
+        }
+        fcntl(q->fd[v6], F_SETFD, FD_CLOEXEC);
+        fcntl(q->fd[v6], F_SETFL, fcntl(q->fd[v6], F_GETFL) | O_NONBLOCK);
+    }
+    if (q->fd[0] == -1 && q->fd[1] == -1) {
+        free(q);
+        return NULL;
+    }
+
+    q->lookup[0].type = TYPE_A;
+    q->lookup[0].id = random_id();
+    q->lookup[1].type = TYPE_AAAA;
+    q->lookup[1].id = q->lookup[0].id + 1;
+    q->deadline = monotonic_ms() + TIMEOUT_MS;
+    q->next_send = monotonic_ms() + RETRY_MS;
+    send_queries(q);
+    return q;
+}
+
+int dns_pollfds(struct dns_query *q, struct pollfd *pfd, int max)
+{
+    int i, n = 0;
+
+    for (i = 0; i < 2 && n < max; i++) {
+        if (q->fd[i] == -1)
+            continue;
+        pfd[n].fd = q->fd[i];
+        pfd[n].events = POLLIN;
+        pfd[n].revents = 0;
+        n++;
+    }
+    return n;
+}
+
+int dns_timeout(struct dns_query *q)
+{
+    unsigned long long now = monotonic_ms();
+    unsigned long long next = q->next_send;
+
+    if (q->cached)
+        return 0;
+    if (q->deadline < next)
+        next = q->deadline;
+    return next > now ? (int)(next - now) : 0;
+}
+
+static int from_server(const struct sockaddr *sa)
+{
+    int i;
+
+    for (i = 0; i < server_count; i++) {
+        const struct dns_server *s = &servers[i];
+        if (s->u.sa.sa_family != sa->sa_family)
+            continue;
+        if (sa->sa_family == AF_INET
+         && s->u.sin.sin_port == ((struct sockaddr_in *)sa)->sin_port
+         && s->u.sin.sin_addr.s_addr == ((struct sockaddr_in *)sa)->sin_addr.s_addr)
+            return 1;
+        if (sa->sa_family == AF_INET6
+         && s->u.sin6.sin6_port == ((struct sockaddr_in6 *)sa)->sin6_port
+         && !memcmp(&s->u.sin6.sin6_addr, &((struct sockaddr_in6 *)sa)->sin6_addr,
+                    sizeof(struct in6_addr)))
+            return 1;
+    }
+    return 0;
+}
+
+int poll_dns(struct dns_query *q)
+{
+    unsigned long long now;
+    int i;
+
+    if (q->cached)
+        return 1;
+
+    for (i = 0; i < 2; i++) {
+        unsigned char msg[1500];
+        struct dns_server from;
+        int len;
+
+        if (q->fd[i] == -1)
+            continue;
+        while (1) {
+            from.len = sizeof(from.u);
+            len = recvfrom(q->fd[i], msg, sizeof(msg), 0, &from.u.sa, &from.len);
+            if (len < 0)
+                break;
+            if (from_server(&from.u.sa))
+                parse_response(q, msg, len);
+        }
+    }
+
+    if (q->lookup[0].done && q->lookup[1].done)
+        goto done;
+
+    now = monotonic_ms();
+    if (now >= q->deadline) {
+        ERROR("Timed out looking up %s", q->name);
+        goto done;
+    }
+    if (now >= q->next_send) {
+        send_queries(q);
+        q->next_send = now + RETRY_MS;
+    }
+    return 0;
+
+ done:
+    q->lookup[0].done = q->lookup[1].done = 1;
+    if (!q->lookup[0].count && !q->lookup[1].count)
+        return -1;
+    cache_store(q);
+    return 1;
+}
+
+int dns_addrs(struct dns_query *q, struct dns_addr *addrs, int max)
+{
+    struct lookup *v4 = &q->lookup[0];
+    struct lookup *v6 = &q->lookup[1];
+    int i, n = 0;
+
+    if (q->cached) {
+        for (i = 0; i < q->entry->count && n < max; i++)
+            addrs[n++] = q->entry->addrs[i];
+        return n;
+    }
+
+    for (i = 0; (i < v4->count || i < v6->count) && n < max; i++) {
+        if (i < v6->count)
+            addrs[n++] = v6->addrs[i];
+        if (i < v4->count && n < max)
+            addrs[n++] = v4->addrs[i];
+    }
+    return n;
+}
+
+void stop_dns(struct dns_query *q)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+        if (q->fd[i] != -1)
+            close(q->fd[i]);
+    free(q);
+}
@@ -0,0 +1,40 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+#include <poll.h>
+#include <netinet/in.h>
+
+#define DNS_MAX_ADDRS 8
+
+struct dns_addr {
+    int family;                 /* AF_INET or AF_INET6 */
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } u;
+};
+
+struct dns_query;
+
+/* Non-blocking lookup of the A and AAAA records for name.  Returns NULL
+ * if there are no nameservers to ask. */
+struct dns_query *start_dns(const char *name);
+
+/* Fill pfd with the sockets to wait on, and return how many there are */
+int dns_pollfds(struct dns_query *query, struct pollfd *pfd, int max);
+
+/* Milliseconds until poll_dns() wants to be called again */
+int dns_timeout(struct dns_query *query);
+
+/* Read answers and resend queries that are due.  Returns 1 once both
+ * lookups are finished, 0 while still waiting, -1 if nothing was found */
+int poll_dns(struct dns_query *query);
+
+/* Copy the addresses found so far, IPv6 and IPv4 interleaved */
+int dns_addrs(struct dns_query *query, struct dns_addr *addrs, int max);
+
+void stop_dns(struct dns_query *query);
+
+/* Read nameservers from path instead of /etc/resolv.conf.  Each
+ * "nameserver" line may give a port as "address#port". */
+void set_dns_config(const char *path);
+#endif /* __DNS_H__ */
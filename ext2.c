@@ -0,0 +1,426 @@
+#define _GNU_SOURCE /* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "ext2.h"
+#include "log.h"
+
+/*
+ * Just enough of ext2 (and ext3, ignoring the journal) to find a file
+ * by name and read it: no extents, no writing.  Anything we don't
+ * understand makes us give up, so the caller can mount instead.
+ */
+#define EXT2_SUPER_OFFSET   1024
+#define EXT2_SUPER_MAGIC    0xef53
+#define EXT2_ROOT_INO       2
+#define EXT2_NDIR_BLOCKS    12
+
+/* Incompatible features we can live with: directory entry file types,
+ * and block groups with their tables packed together */
+#define EXT2_INCOMPAT_FILETYPE  0x0002
+#define EXT2_INCOMPAT_FLEX_BG   0x0200
+#define EXT2_INCOMPAT_OK        (EXT2_INCOMPAT_FILETYPE | EXT2_INCOMPAT_FLEX_BG)
+
+#define EXT4_EXTENTS_FL     0x00080000
+#define S_IFMT_EXT2         0xf000
+#define S_IFREG_EXT2        0x8000
+#define S_IFDIR_EXT2        0x4000
+
+/* Biggest single read; also the alignment for O_DIRECT */
+#define EXT2_READ_SIZE      (1024 * 1024)
+#define EXT2_ALIGN          4096
+
+struct ext2_fs {
+    const char *dev;
+    int fd;
+    int direct;
+    unsigned block_size;
+    unsigned blocks_per_group;
+    unsigned inodes_per_group;
+    unsigned inode_size;
+    unsigned first_data_block;
+    unsigned groups;
+    char *block;                /* one block of scratch space */
+    char *indirect[3];          /* one block per level of indirection */
+};
+
+struct ext2_inode {
+    unsigned mode;
+    unsigned flags;
+    off_t size;
+    uint32_t block[15];
+};
+
+static unsigned le16(const void *p) {
+    const unsigned char *b = p;
+    return b[0] | b[1] << 8;
+}
+
+static uint32_t le32(const void *p) {
+    const unsigned char *b = p;
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static int read_at(struct ext2_fs *fs, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(fs->fd, (char *)buf + done, len - done,
+                          offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL && fs->direct) {
+            /* Blocks smaller than the device's sectors */
+            fcntl(fs->fd, F_SETFL, fcntl(fs->fd, F_GETFL) & ~O_DIRECT);
+            fs->direct = 0;
+            continue;
+        }
+        if (n <= 0) {
+            PERROR("Unable to read %s at %lld", fs->dev,
+                (long long)(offset + done));
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int read_block(struct ext2_fs *fs, void *buf, uint32_t block) {
+    return read_at(fs, buf, fs->block_size, (off_t)block * fs->block_size);
+}
+
+static int open_fs(struct ext2_fs *fs, const char *dev) {
+    char *super;
+    unsigned log_block_size, incompat;
+    uint32_t blocks;
+    int i;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->dev = dev;
+    fs->fd = open(dev, O_RDONLY | O_DIRECT);
+    if (fs->fd != -1)
+        fs->direct = 1;
+    else
+        fs->fd = open(dev, O_RDONLY);
+    if (fs->fd == -1) {
+        PERROR("Unable to open %s", dev);
+        return -1;
+    }
+
+    /* Read the first 4k, so O_DIRECT is happy whatever the sector size */
+    if (posix_memalign((void **)&super, EXT2_ALIGN, EXT2_ALIGN))
+        goto fail;
+    if (read_at(fs, super, EXT2_ALIGN, 0)) {
+        free(super);
+        goto fail;
+    }
+
+    if (le16(super + EXT2_SUPER_OFFSET + 56) != EXT2_SUPER_MAGIC) {
+        ERROR("%s doesn't have an ext2 filesystem", dev);
+        free(super);
+        goto fail;
+    }
+    blocks = le32(super + EXT2_SUPER_OFFSET + 4);
+    fs->first_data_block = le32(super + EXT2_SUPER_OFFSET + 20);
+    log_block_size = le32(super + EXT2_SUPER_OFFSET + 24);
+    fs->blocks_per_group = le32(super + EXT2_SUPER_OFFSET + 32);
+    fs->inodes_per_group = le32(super + EXT2_SUPER_OFFSET + 40);
+    fs->inode_size = 128;
+    incompat = 0;
+    if (le32(super + EXT2_SUPER_OFFSET + 76) >= 1) {
+        fs->inode_size = le16(super + EXT2_SUPER_OFFSET + 88);
+        incompat = le32(super + EXT2_SUPER_OFFSET + 96);
+    }
+    free(super);
+
+    if (incompat & ~EXT2_INCOMPAT_OK) {
+        NOTE("%s uses ext2 features 0x%x, which we can't read",
+            dev, incompat & ~EXT2_INCOMPAT_OK);
+        goto fail;
+    }
+    if (log_block_size > 6 || !fs->blocks_per_group
+     || !fs->inodes_per_group || fs->inode_size < 128) {
+        ERROR("%s has a damaged ext2 superblock", dev);
+        goto fail;
+    }
+    fs->block_size = 1024 << log_block_size;
+    fs->groups = (blocks - fs->first_data_block + fs->blocks_per_group - 1)
+               / fs->blocks_per_group;
+
+    if (posix_memalign((void **)&fs->block, EXT2_ALIGN, fs->block_size))
+        goto fail;
+    for (i = 0; i < 3; i++)
+        if (posix_memalign((void **)&fs->indirect[i], EXT2_ALIGN,
+                           fs->block_size))
+            goto fail;
+    return 0;
+
+ fail:
+    free(fs->block);
+    for (i = 0; i < 3; i++)
+        free(fs->indirect[i]);
+    close(fs->fd);
+    return -1;
+}
+
+static void close_fs(struct ext2_fs *fs) {
+    int i;
+
+    free(fs->block);
+    for (i = 0; i < 3; i++)
+        free(fs->indirect[i]);
+    close(fs->fd);
+}
+
+static int read_inode(struct ext2_fs *fs, uint32_t ino, struct ext2_inode *inode) {
+    unsigned group = (ino - 1) / fs->inodes_per_group;
+    unsigned index = (ino - 1) % fs->inodes_per_group;
+    uint32_t desc_block, table;
+    off_t offset;
+    char *raw;
+    int i;
+
+    if (!ino || group >= fs->groups) {
+        ERROR("Bad inode number %u on %s", ino, fs->dev);
+        return -1;
+    }
+
+    /* The group descriptors follow the superblock's block */
+    desc_block = fs->first_data_block + 1 + group * 32 / fs->block_size;
+    if (read_block(fs, fs->block, desc_block))
+        return -1;
+    table = le32(fs->block + group * 32 % fs->block_size + 8);
+
+    offset = (off_t)table * fs->block_size + (off_t)index * fs->inode_size;
+    if (read_block(fs, fs->block, offset / fs->block_size))
+        return -1;
+    raw = fs->block + offset % fs->block_size;
+
+    inode->mode = le16(raw);
+    inode->size = le32(raw + 4);
+    inode->flags = le32(raw + 32);
+    if ((inode->mode & S_IFMT_EXT2) == S_IFREG_EXT2)
+        inode->size |= (off_t)le32(raw + 108) << 32;
+    for (i = 0; i < 15; i++)
+        inode->block[i] = le32(raw + 40 + i * 4);
+
+    if (inode->flags & EXT4_EXTENTS_FL) {
+        NOTE("Inode %u on %s uses extents, which we can't read",
+            ino, fs->dev);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Physical block for each logical block of the file.  Indirect blocks
+ * are cached one per level, so walking the file in order reads each
+ * of them once.
+ */
+struct block_map {
+    struct ext2_fs *fs;
+    struct ext2_inode *inode;
+    uint32_t cached[3];
+};
+
+static int map_block(struct block_map *map, uint32_t logical, uint32_t *physical) {
+    struct ext2_fs *fs = map->fs;
+    uint32_t per = fs->block_size / 4;
+    uint32_t index[3], block;
+    int depth, level;
+
+    if (logical < EXT2_NDIR_BLOCKS) {
+        *physical = map->inode->block[logical];
+        return 0;
+    }
+    logical -= EXT2_NDIR_BLOCKS;
+    for (depth = 1; depth <= 3; depth++) {
+        uint64_t span = 1;
+        for (level = 0; level < depth; level++)
+            span *= per;
+        if (logical < span)
+            break;
+        logical -= span;
+    }
+    if (depth > 3) {
+        ERROR("File on %s is too big", fs->dev);
+        return -1;
+    }
+
+    for (level = depth - 1; level >= 0; level--) {
+        index[level] = logical % per;
+        logical /= per;
+    }
+
+    block = map->inode->block[EXT2_NDIR_BLOCKS + depth - 1];
+    for (level = 0; level < depth && block; level++) {
+        if (map->cached[level] != block) {
+            if (read_block(fs, fs->indirect[level], block))
+                return -1;
+            map->cached[level] = block;
+            /* Anything below this level is now stale */
+            if (level + 1 < 3)
+                map->cached[level + 1] = 0;
+        }
+        block = le32(fs->indirect[level] + index[level] * 4);
+    }
+    *physical = block;
+    return 0;
+}
+
+/*
+ * Hand the file to put() in runs of physically contiguous blocks, up to
+ * EXT2_READ_SIZE at a time.  Holes read as zeros.
+ */
+static int read_file(struct ext2_fs *fs, struct ext2_inode *inode,
+                     int (*put)(void *, const void *, size_t), void *dat) {
+    struct block_map map = { fs, inode, { 0, 0, 0 } };
+    uint32_t per_read = EXT2_READ_SIZE / fs->block_size;
+    uint32_t nblocks = (inode->size + fs->block_size - 1) / fs->block_size;
+    uint32_t logical = 0;
+    off_t left = inode->size;
+    char *buf;
+    int ret = 0;
+
+    if (posix_memalign((void **)&buf, EXT2_ALIGN, EXT2_READ_SIZE))
+        return EXT2_UNREADABLE;
+
+    while (logical < nblocks && !ret) {
+        uint32_t start, next, count = 1;
+        size_t len;
+
+        if (map_block(&map, logical, &start)) {
+            ret = EXT2_UNREADABLE;
+            break;
+        }
+        while (count < per_read && logical + count < nblocks) {
+            if (map_block(&map, logical + count, &next)) {
+                ret = EXT2_UNREADABLE;
+                break;
+            }
+            if (start ? next != start + count : next != 0)
+                break;
+            count++;
+        }
+        if (ret)
+            break;
+
+        len = count * fs->block_size;
+        if (!start)
+            memset(buf, 0, len);
+        else if (read_at(fs, buf, len, (off_t)start * fs->block_size)) {
+            ret = EXT2_UNREADABLE;
+            break;
+        }
+
+        if (len > left)
+            len = left;
+        ret = put(dat, buf, len);
+        if (ret < 0)
+            ret = EXT2_ABORTED;
+        left -= len;
+        logical += count;
+    }
+
+    free(buf);
+    return ret < 0 ? ret : 0;
+}
+
+/* Directory lookup.  read_file() hands over whole blocks, and entries
+ * never cross a block, so each piece can be walked on its own. */
+struct dir_search {
+    const char *name;
+    size_t name_len;
+    uint32_t ino;
+};
+
+static int search_dir(void *_search, const void *buf, size_t len) {
+    struct dir_search *search = _search;
+    const unsigned char *p = buf;
+    size_t off = 0;
+
+    while (off + 8 <= len) {
+        uint32_t ino = le32(p + off);
+        unsigned rec_len = le16(p + off + 4);
+        unsigned name_len = p[off + 6];
+
+        if (rec_len < 8 || off + rec_len > len)
+            break;
+        if (ino && name_len == search->name_len
+         && off + 8 + name_len <= len
+         && !memcmp(p + off + 8, search->name, name_len)) {
+            search->ino = ino;
+            return 1;
+        }
+        off += rec_len;
+    }
+    return 0;
+}
+
+static int lookup(struct ext2_fs *fs, const char *path, struct ext2_inode *inode) {
+    uint32_t ino = EXT2_ROOT_INO;
+
+    if (read_inode(fs, ino, inode))
+        return -1;
+
+    while (*path) {
+        struct dir_search search;
+        const char *end;
+
+        while (*path == '/')
+            path++;
+        if (!*path)
+            break;
+        end = strchrnul(path, '/');
+
+        if ((inode->mode & S_IFMT_EXT2) != S_IFDIR_EXT2) {
+            ERROR("Looking for %s on %s, found a file where a directory "
+                  "should be", path, fs->dev);
+            return -1;
+        }
+
+        memset(&search, 0, sizeof(search));
+        search.name = path;
+        search.name_len = end - path;
+        if (read_file(fs, inode, search_dir, &search) || !search.ino) {
+            NOTE("%.*s isn't on %s", (int)(end - path), path, fs->dev);
+            return -1;
+        }
+        ino = search.ino;
+        if (read_inode(fs, ino, inode))
+            return -1;
+        path = end;
+    }
+    return 0;
+}
+
+int read_ext2_file(const char *dev, const char *path,
+                   int (*put)(void *, const void *, size_t), void *dat) {
+    struct ext2_fs fs;
+    struct ext2_inode inode;
+    int ret;
+
+    if (open_fs(&fs, dev))
+        return EXT2_UNREADABLE;
+
+    if (lookup(&fs, path, &inode))
+        ret = EXT2_UNREADABLE;
+    else if ((inode.mode & S_IFMT_EXT2) != S_IFREG_EXT2) {
+        ERROR("%s on %s isn't a regular file", path, dev);
+        ret = EXT2_UNREADABLE;
+    }
+    else {
+        NOTE("Reading %s from %s (%lld bytes, %u-byte blocks%s)",
+            path, dev, (long long)inode.size, fs.block_size,
+            fs.direct ? ", O_DIRECT" : "");
+        ret = read_file(&fs, &inode, put, dat);
+    }
+
+    close_fs(&fs);
+    return ret;
+}
@@ -0,0 +1,21 @@
+#ifndef __EXT2_H__
+#define __EXT2_H__
+#include <sys/types.h>
+
+/* read_ext2_file() results other than 0 */
+#define EXT2_UNREADABLE -2      /* not a filesystem we can read: mount it */
+#define EXT2_ABORTED    -3      /* put() failed */
+
+/*
+ * Read path off the ext2 filesystem on dev (a block device or an image
+ * file) without mounting it.  The file's block list is worked out from
+ * its inode, and put() gets the contents in large contiguous pieces.
+ * put() returns 0 to carry on, a positive number to stop early, or a
+ * negative number to give up.
+ *
+ * Returns 0 once the whole file (or as much as put() wanted) has been
+ * read, or one of the codes above.
+ */
+int read_ext2_file(const char *dev, const char *path,
+                   int (*put)(void *, const void *, size_t), void *dat);
+#endif /* __EXT2_H__ */
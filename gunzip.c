@@ -42,6 +42,9 @@
 #include <strings.h>
 #include <errno.h>
 #include "log.h"
+#include "gunzip.h"
+#include "trace.h"
+#include "clock.h"
 
 typedef int smallint;
 typedef unsigned smalluint;
@@ -94,9 +97,13 @@ typedef struct state_t {
 	uint32_t gunzip_crc;
 
 	FILE *gunzip_src_file;
-	int (*update_progress)(void *dat, int sofar);
+	int (*update_progress)(void *dat, struct unpack_progress *p);
 	void *my_data;
-	unsigned total_read;
+	int (*write_output)(void *dat, const void *buf, size_t len);
+	void *write_data;
+	off_t total_read;
+	struct unpack_progress gunzip_progress;
+	unsigned long long gunzip_progress_ms; /* when the rates were last updated */
 	unsigned gunzip_outbuf_count; /* bytes in output buffer */
 
 	unsigned char *gunzip_window;
@@ -147,7 +154,11 @@ typedef struct state_t {
 #define gunzip_crc          (S()gunzip_crc         )
 #define update_progress     (S()update_progress    )
 #define my_data             (S()my_data            )
+#define write_output        (S()write_output       )
+#define write_data          (S()write_data         )
 #define total_read          (S()total_read         )
+#define gunzip_progress     (S()gunzip_progress    )
+#define gunzip_progress_ms  (S()gunzip_progress_ms )
 #define gunzip_src_file     (S()gunzip_src_file    )
 #define gunzip_outbuf_count (S()gunzip_outbuf_count)
 #define gunzip_window       (S()gunzip_window      )
@@ -404,6 +415,36 @@ static void abort_unzip(STATE_PARAM_ONLY)
 	longjmp(error_jmp, 1);
 }
 
+/* Called whenever more compressed data has been read.  Byte counts are
+ * always current; the rates are recomputed about once a second. */
+static void report_progress(STATE_PARAM_ONLY)
+{
+	unsigned long long now;
+
+	if (!update_progress)
+		return;
+
+	now = monotonic_ms();
+	if (!gunzip_progress_ms)
+		gunzip_progress_ms = now;
+	else if (now - gunzip_progress_ms >= 1000) {
+		unsigned elapsed = now - gunzip_progress_ms;
+		gunzip_progress.in_rate = (total_read - gunzip_progress.compressed) * 1000 / elapsed;
+		gunzip_progress.out_rate = (gunzip_bytes_out - gunzip_progress.uncompressed) * 1000 / elapsed;
+		gunzip_progress.compressed = total_read;
+		gunzip_progress.uncompressed = gunzip_bytes_out;
+		gunzip_progress_ms = now;
+	}
+
+	/* Hand out a copy so the rate baseline above stays intact */
+	{
+		struct unpack_progress p = gunzip_progress;
+		p.compressed = total_read;
+		p.uncompressed = gunzip_bytes_out;
+		update_progress(my_data, &p);
+	}
+}
+
 static unsigned fill_bitbuffer(STATE_PARAM unsigned bitbuffer, unsigned *current, const unsigned required)
 {
 	while (*current < required) {
@@ -423,13 +464,12 @@ static unsigned fill_bitbuffer(STATE_PARAM unsigned bitbuffer, unsigned *current
 				to_read -= bytebuffer_size;
 			bytebuffer_size += 4;
 			bytebuffer_offset = 4;
+			report_progress(PASS_STATE_ONLY);
 		}
 		bitbuffer |= ((unsigned) bytebuffer[bytebuffer_offset]) << *current;
 		bytebuffer_offset++;
 		*current += 8;
 	}
-	if (update_progress)
-		update_progress(my_data, total_read);
 	return bitbuffer;
 }
 
@@ -1159,7 +1199,11 @@ inflate_unzip_internal(STATE_PARAM FILE *in, int out)
 
 	while (1) {
 		int r = inflate_get_next_window(PASS_STATE_ONLY);
-		nwrote = full_write(out, gunzip_window, gunzip_outbuf_count);
+		if (write_output)
+			nwrote = write_output(write_data, gunzip_window, gunzip_outbuf_count)
+				? -1 : (ssize_t)gunzip_outbuf_count;
+		else
+			nwrote = full_write(out, gunzip_window, gunzip_outbuf_count);
 		if (nwrote != (ssize_t)gunzip_outbuf_count) {
 			PERROR("write");
 			n = -1;
@@ -1206,13 +1250,10 @@ static int top_up(STATE_PARAM unsigned n)
 		}
 		total_read += bytebuffer_size;
 		bytebuffer_size += count;
+		report_progress(PASS_STATE_ONLY);
 		if (bytebuffer_size < n)
 			return 0;
 	}
-	if (update_progress)
-		update_progress(my_data, total_read);
-    else
-        ERROR("No update_progress!\n");
 	return 1;
 }
 
@@ -1319,7 +1360,9 @@ static int check_header_gzip(STATE_PARAM unpack_info_t *info)
 }
 
 static int 
-unpack_gz_stream_with_info(FILE *in, int out, unpack_info_t *info, int (*upd)(void *,int), void *dat)
+unpack_gz_stream_with_info(FILE *in, int out, unpack_info_t *info,
+		int (*put)(void *, const void *, size_t), void *put_dat,
+		int (*upd)(void *, struct unpack_progress *), void *dat)
 {
 	uint32_t v32;
 	int n;
@@ -1335,6 +1378,9 @@ unpack_gz_stream_with_info(FILE *in, int out, unpack_info_t *info, int (*upd)(vo
 
     update_progress = upd;
     my_data = dat;
+    write_output = put;
+    write_data = put_dat;
+    trace_begin("inflate", "unpack_gz_stream");
 
  again:
 	if (!check_header_gzip(PASS_STATE info)) {
@@ -1380,13 +1426,14 @@ unpack_gz_stream_with_info(FILE *in, int out, unpack_info_t *info, int (*upd)(vo
 	/*ERROR("decompression OK, trailing garbage ignored");*/
 
  ret:
+	trace_end("inflate", "unpack_gz_stream");
 	free(bytebuffer);
 	DEALLOC_STATE;
 	return n;
 }
 
-int 
-unpack_gz_stream(FILE *in, int out, int (*upd)(void *,int), void *dat)
+static int
+check_gz_magic(FILE *in)
 {
     /* Verify the stream is good */
     unsigned char magic[2];
@@ -1405,7 +1452,25 @@ unpack_gz_stream(FILE *in, int out, int (*upd)(void *,int), void *dat)
         ERROR("Invalid gzip magic (wanted 0x1f8b  got 0x%02x%02x  res %d)\n", magic[0], magic[1], res);
         return -1;
     }
-	return unpack_gz_stream_with_info(in, out, NULL, upd, dat);
+    return 0;
+}
+
+int 
+unpack_gz_stream(FILE *in, int out,
+		int (*upd)(void *, struct unpack_progress *), void *dat)
+{
+	if (check_gz_magic(in))
+		return -1;
+	return unpack_gz_stream_with_info(in, out, NULL, NULL, NULL, upd, dat);
+}
+
+int
+unpack_gz_stream_cb(FILE *in, int (*put)(void *, const void *, size_t),
+		void *put_dat, int (*upd)(void *, struct unpack_progress *), void *dat)
+{
+	if (check_gz_magic(in))
+		return -1;
+	return unpack_gz_stream_with_info(in, -1, NULL, put, put_dat, upd, dat);
 }
 
 
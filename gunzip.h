@@ -1,4 +1,21 @@
 #ifndef __GUNZIP_H__
 #define __GUNZIP_H__
-int unpack_gz_stream(FILE *in, int out, int (*upd)(void *,int), void *dat);
+#include <stdio.h>
+#include <sys/types.h>
+
+struct unpack_progress {
+    off_t compressed;       /* bytes read from the input stream */
+    off_t uncompressed;     /* bytes written out */
+    unsigned in_rate;       /* compressed bytes/sec over the last second */
+    unsigned out_rate;      /* uncompressed bytes/sec over the last second */
+};
+
+int unpack_gz_stream(FILE *in, int out,
+                     int (*upd)(void *, struct unpack_progress *), void *dat);
+
+/* As above, but each window of output goes to put() instead of a file
+ * descriptor.  put() returns nonzero to abort. */
+int unpack_gz_stream_cb(FILE *in, int (*put)(void *, const void *, size_t),
+                        void *put_dat,
+                        int (*upd)(void *, struct unpack_progress *), void *dat);
 #endif /* __GUNZIP_H__ */
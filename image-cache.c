@@ -0,0 +1,389 @@
+#define _GNU_SOURCE /* fopencookie */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "crc32.h"
+#include "image-cache.h"
+#include "ufdisk.h"
+#include "log.h"
+
+/* At close, how much unread input we're prepared to swallow to find
+ * out whether the copy is complete (gzip trailer padding and the like) */
+#define TEE_DRAIN_MAX 65536
+
+/*
+ * On the card, the image is kept in space no partition covers, after a
+ * header sector.  The header is marked pending before the old image is
+ * overwritten, and only marked done, with the image's length and
+ * checksum, once every byte of the new one is on the card.
+ */
+#define CARD_MAGIC          "NeTVimg1"
+#define CARD_HEADER_SIZE    4096
+#define CARD_PENDING        1
+#define CARD_DONE           2
+
+struct card_header {
+    char magic[8];
+    uint32_t state;
+    uint32_t crc;           /* of the image */
+    uint64_t length;
+    char url[256];
+    char etag[WGET_VALIDATOR_MAX];
+    char last_modified[WGET_VALIDATOR_MAX];
+    uint32_t header_crc;    /* of everything above */
+};
+
+static void meta_path(struct image_cache *cache, char *buf, int size, const char *ext) {
+    snprintf(buf, size, "%s%s", cache->path, ext);
+}
+
+static void clear_validators(struct image_cache *cache) {
+    bzero(&cache->validators, sizeof(cache->validators));
+    cache->validators.length = -1;
+    cache->has_crc = 0;
+    cache->valid = 0;
+}
+
+int load_image_cache(struct image_cache *cache, const char *path) {
+    char name[300];
+    char line[WGET_VALIDATOR_MAX + 32];
+    struct stat st;
+    FILE *meta;
+
+    bzero(cache, sizeof(*cache));
+    snprintf(cache->path, sizeof(cache->path), "%s", path);
+    clear_validators(cache);
+
+    meta_path(cache, name, sizeof(name), ".meta");
+    meta = fopen(name, "r");
+    if (!meta)
+        return -1;
+
+    while (fgets(line, sizeof(line), meta)) {
+        char *value = strchr(line, '=');
+        if (!value)
+            continue;
+        *value++ = '\0';
+        value[strcspn(value, "\r\n")] = '\0';
+        if (!strcmp(line, "etag"))
+            snprintf(cache->validators.etag,
+                     sizeof(cache->validators.etag), "%s", value);
+        else if (!strcmp(line, "last-modified"))
+            snprintf(cache->validators.last_modified,
+                     sizeof(cache->validators.last_modified), "%s", value);
+        else if (!strcmp(line, "length"))
+            cache->validators.length = strtoll(value, NULL, 10);
+        else if (!strcmp(line, "crc")) {
+            cache->crc = strtoul(value, NULL, 16);
+            cache->has_crc = 1;
+        }
+    }
+    fclose(meta);
+
+    /* The length is what tells us the copy is whole */
+    if (stat(cache->path, &st) || cache->validators.length < 0
+     || st.st_size != cache->validators.length
+     || (!cache->validators.etag[0] && !cache->validators.last_modified[0])) {
+        NOTE("Cached image at %s is incomplete or stale", cache->path);
+        clear_validators(cache);
+        return -1;
+    }
+
+    NOTE("Cached image at %s: %lld bytes, etag %s, modified %s",
+        cache->path, (long long)cache->validators.length,
+        cache->validators.etag[0] ? cache->validators.etag : "-",
+        cache->validators.last_modified[0] ?
+            cache->validators.last_modified : "-");
+    cache->valid = 1;
+    return 0;
+}
+
+static uint32_t header_crc(struct card_header *h) {
+    return crc32_update(0, h, offsetof(struct card_header, header_crc));
+}
+
+static int write_card_header(struct image_cache *cache, int state) {
+    struct card_header h;
+    int fd, ret = 0;
+
+    bzero(&h, sizeof(h));
+    memcpy(h.magic, CARD_MAGIC, sizeof(h.magic));
+    h.state = state;
+    if (state == CARD_DONE) {
+        h.crc = cache->written_crc;
+        h.length = cache->written;
+        snprintf(h.url, sizeof(h.url), "%s", cache->url);
+        snprintf(h.etag, sizeof(h.etag), "%s", cache->validators.etag);
+        snprintf(h.last_modified, sizeof(h.last_modified), "%s",
+                 cache->validators.last_modified);
+    }
+    h.header_crc = header_crc(&h);
+
+    fd = open(cache->path, O_WRONLY);
+    if (fd == -1) {
+        PERROR("Unable to open %s for the image cache", cache->path);
+        return -1;
+    }
+    if (pwrite(fd, &h, sizeof(h), cache->card_offset) != sizeof(h)
+     || fsync(fd)) {
+        PERROR("Unable to write image cache header");
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+
+int load_card_cache(struct image_cache *cache, const char *dev,
+                    const char *url) {
+    struct card_header h;
+    int fd;
+
+    bzero(cache, sizeof(*cache));
+    snprintf(cache->path, sizeof(cache->path), "%s", dev);
+    snprintf(cache->url, sizeof(cache->url), "%s", url);
+    clear_validators(cache);
+    cache->on_card = 1;
+
+    if (cache_region(dev, &cache->card_offset, &cache->card_length)
+     || cache->card_length <= CARD_HEADER_SIZE) {
+        NOTE("No room on %s for an image cache", dev);
+        return -2;
+    }
+
+    fd = open(dev, O_RDONLY);
+    if (fd == -1) {
+        PERROR("Unable to open %s for the image cache", dev);
+        return -2;
+    }
+    if (pread(fd, &h, sizeof(h), cache->card_offset) != sizeof(h)) {
+        PERROR("Unable to read image cache header");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    h.url[sizeof(h.url) - 1] = '\0';
+    h.etag[sizeof(h.etag) - 1] = '\0';
+    h.last_modified[sizeof(h.last_modified) - 1] = '\0';
+    if (memcmp(h.magic, CARD_MAGIC, sizeof(h.magic))
+     || h.header_crc != header_crc(&h)) {
+        NOTE("No image cached on %s", dev);
+        return -1;
+    }
+    if (h.state != CARD_DONE || !h.length
+     || h.length > (uint64_t)(cache->card_length - CARD_HEADER_SIZE)
+     || (!h.etag[0] && !h.last_modified[0])) {
+        NOTE("Image cached on %s is incomplete", dev);
+        return -1;
+    }
+    if (strcmp(h.url, url)) {
+        NOTE("Image cached on %s is of %s", dev, h.url);
+        return -1;
+    }
+
+    strcpy(cache->validators.etag, h.etag);
+    strcpy(cache->validators.last_modified, h.last_modified);
+    cache->validators.length = h.length;
+    cache->crc = h.crc;
+    cache->has_crc = 1;
+    cache->valid = 1;
+    NOTE("Cached image on %s: %lld bytes, etag %s, modified %s", dev,
+        (long long)cache->validators.length,
+        h.etag[0] ? h.etag : "-",
+        h.last_modified[0] ? h.last_modified : "-");
+    return 0;
+}
+
+off_t image_cache_offset(struct image_cache *cache) {
+    return cache->on_card ? cache->card_offset + CARD_HEADER_SIZE : 0;
+}
+
+void invalidate_image_cache(struct image_cache *cache) {
+    char name[300];
+
+    NOTE("Dropping cached image in %s", cache->path);
+    if (cache->on_card)
+        write_card_header(cache, CARD_PENDING);
+    else {
+        meta_path(cache, name, sizeof(name), ".meta");
+        unlink(name);
+    }
+    clear_validators(cache);
+}
+
+static ssize_t tee_read(void *cookie, char *buf, size_t size) {
+    struct image_cache *cache = cookie;
+    size_t n;
+
+    n = fread(buf, 1, size, cache->in);
+    if (n == 0)
+        return ferror(cache->in) ? -1 : 0;
+
+    if (cache->on_card && !cache->failed
+     && cache->written + (off_t)n > cache->card_length - CARD_HEADER_SIZE) {
+        NOTE("Image is too big to cache on %s", cache->path);
+        cache->failed = 1;
+    }
+    if (!cache->failed && (cache->on_card
+            ? blk_write(cache->card_out, buf, n) != 0
+            : fwrite(buf, 1, n, cache->out) != n)) {
+        PERROR("Unable to save image to %s", cache->path);
+        cache->failed = 1;
+    }
+    cache->written += n;
+    cache->written_crc = crc32_update(cache->written_crc, buf, n);
+    return n;
+}
+
+static int save_meta(struct image_cache *cache) {
+    char name[300], tmp[300];
+    FILE *meta;
+
+    meta_path(cache, name, sizeof(name), ".meta");
+    meta_path(cache, tmp, sizeof(tmp), ".meta.new");
+    meta = fopen(tmp, "w");
+    if (!meta) {
+        PERROR("Unable to create %s", tmp);
+        return -1;
+    }
+    fprintf(meta, "etag=%s\n", cache->validators.etag);
+    fprintf(meta, "last-modified=%s\n", cache->validators.last_modified);
+    fprintf(meta, "length=%lld\n", (long long)cache->written);
+    fprintf(meta, "crc=%08x\n", cache->written_crc);
+    if (fflush(meta) || fsync(fileno(meta))) {
+        PERROR("Unable to write %s", tmp);
+        fclose(meta);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(meta);
+    return rename(tmp, name);
+}
+
+/* Finish the copy on the card, and describe it in the header only once
+ * it's all there */
+static void finish_card_copy(struct image_cache *cache, int complete) {
+    if (close_blk_writer(cache->card_out))
+        complete = 0;
+    cache->card_out = NULL;
+
+    if (!complete)
+        NOTE("Not caching image (%lld bytes saved)", (long long)cache->written);
+    else if (write_card_header(cache, CARD_DONE))
+        ERROR("Unable to save cached image on %s", cache->path);
+    else {
+        NOTE("Cached %lld bytes on %s", (long long)cache->written, cache->path);
+        cache->crc = cache->written_crc;
+        cache->has_crc = 1;
+        cache->valid = 1;
+    }
+}
+
+static void finish_file_copy(struct image_cache *cache, int complete) {
+    char name[300], meta[300];
+
+    meta_path(cache, name, sizeof(name), ".new");
+    if (fflush(cache->out) || fsync(fileno(cache->out)))
+        complete = 0;
+    fclose(cache->out);
+    cache->out = NULL;
+
+    if (!complete) {
+        NOTE("Not caching image (%lld bytes saved)", (long long)cache->written);
+        unlink(name);
+    }
+    else {
+        /* Old validators go first, so a crash can't pair them with
+         * the new image */
+        meta_path(cache, meta, sizeof(meta), ".meta");
+        unlink(meta);
+        if (rename(name, cache->path) || save_meta(cache)) {
+            PERROR("Unable to save cached image %s", cache->path);
+            unlink(name);
+        }
+        else {
+            NOTE("Cached %lld bytes at %s", (long long)cache->written, cache->path);
+            cache->crc = cache->written_crc;
+            cache->has_crc = 1;
+            cache->valid = 1;
+        }
+    }
+}
+
+static int tee_close(void *cookie) {
+    struct image_cache *cache = cookie;
+    struct wget_validators *v = &cache->validators;
+    char buf[4096];
+    size_t n, drained = 0;
+    int complete;
+
+    /* Pick up whatever the reader left behind, within reason */
+    if (v->length < 0 || cache->written < v->length) {
+        while (drained < TEE_DRAIN_MAX
+            && (v->length < 0 || cache->written < v->length)
+            && (n = tee_read(cache, buf, sizeof(buf))) > 0)
+            drained += n;
+    }
+
+    complete = !cache->failed && !ferror(cache->in)
+            && (v->length >= 0 ? cache->written == v->length : feof(cache->in))
+            && (v->etag[0] || v->last_modified[0]);
+    if (cache->on_card)
+        finish_card_copy(cache, complete);
+    else
+        finish_file_copy(cache, complete);
+
+    fclose(cache->in);
+    cache->in = NULL;
+    return 0;
+}
+
+FILE *tee_image_cache(struct image_cache *cache, FILE *in) {
+    static const cookie_io_functions_t tee_funcs = {
+        .read  = tee_read,
+        .close = tee_close,
+    };
+    char name[300];
+    FILE *fp;
+
+    /* The old copy stops counting before any of it is overwritten */
+    if (cache->on_card) {
+        if (write_card_header(cache, CARD_PENDING))
+            return in;
+        cache->card_out = open_blk_writer(cache->path, 0,
+                                          image_cache_offset(cache));
+        if (!cache->card_out) {
+            ERROR("Unable to open %s, not caching", cache->path);
+            return in;
+        }
+    }
+    else {
+        meta_path(cache, name, sizeof(name), ".new");
+        cache->out = fopen(name, "w");
+        if (!cache->out) {
+            PERROR("Unable to create %s, not caching", name);
+            return in;
+        }
+    }
+    cache->in = in;
+    cache->written = 0;
+    cache->written_crc = 0;
+    cache->failed = 0;
+    cache->valid = 0;
+
+    fp = fopencookie(cache, "r", tee_funcs);
+    if (!fp) {
+        PERROR("Unable to create cache stream");
+        if (cache->on_card)
+            finish_card_copy(cache, 0);
+        else
+            finish_file_copy(cache, 0);
+        return in;
+    }
+    return fp;
+}
@@ -0,0 +1,55 @@
+#ifndef __IMAGE_CACHE_H__
+#define __IMAGE_CACHE_H__
+#include <stdio.h>
+#include <stdint.h>
+#include "blkwrite.h"
+#include "wget.h"
+
+/* A local copy of the image, plus the HTTP validators it was served
+ * with, so a later run can ask the server whether it's still current
+ * instead of downloading it again.  The copy is either a file, with
+ * the validators in "<path>.meta", or raw space at the end of the
+ * card, behind a header that holds them. */
+struct image_cache {
+    char path[256];         /* the file, or the card's device */
+    struct wget_validators validators;
+    uint32_t crc;           /* of the copy, if has_crc */
+    int has_crc;
+    int valid;              /* path holds the complete copy described */
+
+    /* Kept on the card: the header's at card_offset, and the image
+     * follows it.  Only a copy of url counts. */
+    int on_card;
+    off_t card_offset;
+    off_t card_length;
+    char url[256];
+
+    /* While a download is being saved */
+    FILE *in;
+    FILE *out;
+    struct blk_writer *card_out;
+    off_t written;
+    uint32_t written_crc;
+    int failed;
+};
+
+/* Load what's cached at path.  Returns 0 if there's a complete copy;
+ * otherwise the validators are cleared, so nothing conditional is sent. */
+int load_image_cache(struct image_cache *cache, const char *path);
+
+/* The same for a copy of url in the spare space on the card dev.
+ * Returns -2 if there's no room on the card to keep one at all. */
+int load_card_cache(struct image_cache *cache, const char *dev,
+                    const char *url);
+
+/* Where in path the cached image starts */
+off_t image_cache_offset(struct image_cache *cache);
+
+/* The copy turned out to be bad, so don't offer it again */
+void invalidate_image_cache(struct image_cache *cache);
+
+/* Returns a stream that reads from in and saves everything it reads.
+ * Closing it closes in, and replaces the cached copy only if the whole
+ * image came through. */
+FILE *tee_image_cache(struct image_cache *cache, FILE *in);
+#endif /* __IMAGE_CACHE_H__ */
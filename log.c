@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "log.h"
+
+/* Held while a line goes out, so lines from different threads don't
+ * run into each other */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void log_line(const char *line) {
+    pthread_mutex_lock(&log_lock);
+    fputs(line, stderr);
+    snprintf(current_debug_message, sizeof(current_debug_message), "%s", line);
+    if (serial_output)
+        fputs(line, serial_output);
+    pthread_mutex_unlock(&log_lock);
+}
+
+void get_debug_message(char *buf, int size) {
+    pthread_mutex_lock(&log_lock);
+    snprintf(buf, size, "%s", current_debug_message);
+    pthread_mutex_unlock(&log_lock);
+}
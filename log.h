@@ -3,32 +3,40 @@
 
 #define DEBUG_MESSAGE_SIZE 1024
 
+/*
+ * Lines are put together on the caller's stack and handed to log_line()
+ * whole, so the pipeline and writer threads can log alongside the UI.
+ */
 #define PERROR(format, arg...)            \
   do { \
-    fprintf(stderr, "%s - %s():%d - " format ": %s\n", __FILE__, __func__, __LINE__, ## arg, strerror(errno)); \
-    snprintf(current_debug_message, sizeof(current_debug_message), "%s - %s():%d - " format ": %s\n", __FILE__, __func__, __LINE__, ## arg, strerror(errno)); \
-    if (serial_output) \
-        fputs(current_debug_message, serial_output); \
+    char log_buf_[DEBUG_MESSAGE_SIZE]; \
+    snprintf(log_buf_, sizeof(log_buf_), "%s - %s():%d - " format ": %s\n", __FILE__, __func__, __LINE__, ## arg, strerror(errno)); \
+    log_line(log_buf_); \
   } while(0)
 
 #define ERROR(format, arg...)            \
   do { \
-    fprintf(stderr, "%s - %s():%d - " format "\n", __FILE__, __func__, __LINE__, ## arg); \
-    snprintf(current_debug_message, sizeof(current_debug_message), "%s - %s():%d - " format "\n", __FILE__, __func__, __LINE__, ## arg); \
-    if (serial_output) \
-        fputs(current_debug_message, serial_output); \
+    char log_buf_[DEBUG_MESSAGE_SIZE]; \
+    snprintf(log_buf_, sizeof(log_buf_), "%s - %s():%d - " format "\n", __FILE__, __func__, __LINE__, ## arg); \
+    log_line(log_buf_); \
   } while(0)
 
 #define NOTE(format, arg...)            \
   do { \
-    fprintf(stderr, "%s - %s():%d - " format "\n", __FILE__, __func__, __LINE__, ## arg); \
-    snprintf(current_debug_message, sizeof(current_debug_message), "%s - %s():%d - " format "\n", __FILE__, __func__, __LINE__, ## arg); \
-    if (serial_output) \
-        fputs(current_debug_message, serial_output); \
+    char log_buf_[DEBUG_MESSAGE_SIZE]; \
+    snprintf(log_buf_, sizeof(log_buf_), "%s - %s():%d - " format "\n", __FILE__, __func__, __LINE__, ## arg); \
+    log_line(log_buf_); \
   } while(0)
 
 #ifndef __LOG_H__
 #define __LOG_H__
 extern char current_debug_message[DEBUG_MESSAGE_SIZE];
 extern FILE *serial_output;
+
+/* Write line to stderr and the serial port, and make it the current
+ * debug message, all in one piece */
+void log_line(const char *line);
+
+/* A copy of the current debug message, for showing it */
+void get_debug_message(char *buf, int size);
 #endif /* __LOG_H__ */
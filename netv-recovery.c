@@ -1,4 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include <SDL/SDL.h>
 #include <SDL_ttf.h>
 #include <unistd.h>
@@ -36,10 +40,21 @@
 #include "myifup.h"
 #include "dhcpc.h"
 #include "udev.h"
+#include "dns.h"
 #include "wget.h"
 #include "gunzip.h"
+#include "pipeline.h"
+#include "blkwrite.h"
+#include "ext2.h"
+#include "source.h"
 #include "config-area.h"
+#include "config.h"
+#include "delta.h"
+#include "planner.h"
+#include "trace.h"
+#include "sim.h"
 #include "log.h"
+#include "clock.h"
 
 #define ICON_W 64
 #define ICON_H 64
@@ -67,7 +82,23 @@ FILE *serial_output;
 
 //#define IMAGE_URL "http://buildbot.chumby.com.sg/build/silvermoon-netv/LATEST/disk-image.gz"
 #define IMAGE_URL "http://netv.bunnie-bar.com/build/silvermoon-netv/LATEST/disk-image.gz"
+
+/* Block checksums of the uncompressed image, for fetching only what's changed */
+#define MANIFEST_URL "http://netv.bunnie-bar.com/build/silvermoon-netv/LATEST/disk-image.manifest"
 #define OTHER_NETWORK_STRING "[Other Network]"
+
+/* Stages the end-of-run report has room for */
+#define MAX_STAGES 12
+
+/* The simulated card's root filesystem partition */
+#define SIM_ROOTFS_SIZE (512 * 1024 * 1024LL)
+
+struct stage_time {
+    const char *name;
+    unsigned long long start_us, us;
+    off_t bytes;
+};
+
 struct recovery_data;
 
 #define MAKEDRAW(x) ((void (*)(void *, void *))x)
@@ -111,11 +142,35 @@ struct recovery_data {
 
     struct ap_description *aps;
 
-    int data_size;
-    int last_data_size;
+    struct image_source source;
+    off_t data_size;
+    off_t last_data_size;
 
     int encryption_type;
     int should_quit;
+
+    /* What to recover onto: a card, whose partitions are named after
+     * it, or an image file written as in simulation mode */
+    const char *card;
+    char config_dev[64];
+    char rootfs_dev[64];
+    const char *output;
+    const char *image_url;
+
+    /* Run without a display, from arguments or the config file.  Scene
+     * changes only record where the run's got to. */
+    int headless;
+    int offline;
+    int state;
+
+    /* How long each stage took, for the report at the end */
+    struct stage_time stages[MAX_STAGES];
+    int nstages;
+
+    /* Scenarios to run against a simulated network and card, and the
+     * one running now */
+    const char *scenarios;
+    const struct sim_scenario *sim;
 };
 
 
@@ -250,200 +305,198 @@ pick_ssid(char *item, void *_data)
     return 0;
 }
 
-
-static int
-write_file_to_config_area(char *file, char *blk, struct config_area *ca, int fd)
+/* Stages don't nest: each one runs until the next starts or it's ended */
+static void
+end_stage(struct recovery_data *data, off_t bytes)
 {
-    struct block_def *bd;
-    int length, offset, block_count;
-    int src;
-
-    bd = ca->block_table;
-    length = 0;
-    offset = 0;
-    block_count = 0;
-    while(!length && !offset && bd->offset != 0xffffffff && block_count < 64) {
-        block_count++;
-        if (!strncmp(blk, bd->n.name, 4)) {
-            length = bd->length;
-            offset = bd->offset;
-            NOTE("Found %s at offset %d, %d bytes long", blk, offset, length);
-        }
-        bd++;
-    }
+    struct stage_time *st;
+
+    if (!data->nstages)
+        return;
+    st = &data->stages[data->nstages - 1];
+    if (st->us)
+        return;
+    st->us = monotonic_us() - st->start_us;
+    if (!st->us)
+        st->us = 1;
+    st->bytes = bytes;
+    trace_end("stage", st->name);
+}
 
-    if (!length || !offset) {
-        ERROR("Couldn't find %s in config block!", blk);
-        return -1;
-    }
+static void
+start_stage(struct recovery_data *data, const char *name)
+{
+    struct stage_time *st;
+
+    end_stage(data, 0);
+    if (data->nstages >= MAX_STAGES)
+        return;
+    st = &data->stages[data->nstages++];
+    st->name = name;
+    st->start_us = monotonic_us();
+    st->us = 0;
+    st->bytes = 0;
+    trace_begin("stage", name);
+}
 
-    src = open(file, O_RDONLY);
-    if (-1 == src) {
-        PERROR("Couldn't open %s", file);
-        return -1;
-    }
+static void
+report_timings(struct recovery_data *data)
+{
+    unsigned long long total = 0;
+    int i;
 
-    if (-1 == lseek(fd, offset, SEEK_SET)) {
-        PERROR("Couldn't seek to offset of %s", blk);
-        close(src);
-        return -1;
+    end_stage(data, 0);
+    if (data->headless)
+        printf("%-10s %10s %12s %10s\n", "stage", "ms", "bytes", "KiB/s");
+    for (i = 0; i < data->nstages; i++) {
+        struct stage_time *st = &data->stages[i];
+        unsigned long long rate = (st->bytes * 1000000ULL / st->us) >> 10;
+
+        NOTE("stage name=%s ms=%llu bytes=%lld kib_s=%llu",
+            st->name, st->us / 1000, (long long)st->bytes, rate);
+        if (data->headless)
+            printf("%-10s %10llu %12lld %10llu\n", st->name, st->us / 1000,
+                   (long long)st->bytes, rate);
+        total += st->us;
     }
-
-    while(length > 0) {
-        int rd, wr;
-        char bfr[4096];
-        rd = read(src, bfr, length>sizeof(bfr)?sizeof(bfr):length);
-        if (rd == -1) {
-            PERROR("Unable to read source kernel");
-            close(src);
-            return -1;
-        }
-        if (!rd) {
-            NOTE("Reached the end of the kernel on disk, with %d bytes left",
-                length);
-            break;
-        }
-
-        wr = write(fd, bfr, rd);
-        if (rd != wr) {
-            PERROR("Unable to write to %s", blk);
-            close(src);
-            return -1;
-        }
-
-        length -= rd;
+    if (data->headless) {
+        printf("%-10s %10llu\n", "total", total / 1000);
+        fflush(stdout);
     }
-
-    close(src);
-    return 0;
 }
 
-
 static int
 restore_kernel(struct recovery_data *data)
 {
-    int fd;
-    struct config_area ca;
-
-    mkdir("/mnt", 0777);
-    if (-1 == mount("/dev/mmcblk0p2", "/mnt", "ext2", MS_RDONLY, NULL)) {
-        PERROR("Couldn't mount filesystem");
-        return -1;
-    }
-
-    fd = open("/dev/mmcblk0p1", O_RDWR);
-    if (-1 == fd) {
-        PERROR("Couldn't open partition 1");
-        umount("/mnt");
+    struct config_area_index ca;
+    struct config_slot_write slots[] = {
+        { "krnA", "/boot/zImage", data->rootfs_dev },
+        { "krnB", "/boot/zImage", data->rootfs_dev },
+        { "logo", "/boot/logo-preparing.raw.gz", data->rootfs_dev },
+    };
+    int nslots = sizeof(slots) / sizeof(*slots);
+    int i, mount_needed = 0;
+
+    if (read_config_area(data->config_dev, &ca))
         return -1;
-    }
 
-    /* The config block is located at the magic offset of 96 */
-    if (-1 == lseek(fd, 96*512, SEEK_SET)) {
-        PERROR("Couldn't seek to config block");
-        umount("/mnt");
-        close(fd);
-        return -1;
-    }
-
-    /* Read the config block straight off the disk */
-    if (read(fd, &ca, sizeof(ca)) != sizeof(ca)) {
-        PERROR("Couldn't read config area");
-        umount("/mnt");
-        close(fd);
-        return -1;
-    }
-
-    /* Verify the config area's signature */
-    if(ca.sig[0] != 'C' || ca.sig[1] != 'f'
-    || ca.sig[2] != 'g' || ca.sig[3] != '*') {
-        ERROR("Config block doesn't have proper signature "
-              " (Wanted Cfg*, got %c%c%c%c)", 
-              ca.sig[0], ca.sig[1],
-              ca.sig[2], ca.sig[3]);
+    /* Everything goes in one pass, read straight off the new filesystem */
+    write_config_slots(&ca, data->config_dev, slots, nslots);
+
+    /* Only mount it if it's something we can't read ourselves */
+    for (i = 0; i < nslots; i++)
+        if (slots[i].result == EXT2_UNREADABLE)
+            mount_needed = 1;
+    if (mount_needed) {
+        char paths[sizeof(slots) / sizeof(*slots)][64];
+        struct config_slot_write retry[sizeof(slots) / sizeof(*slots)];
+        int nretry = 0;
+
+        mkdir("/mnt", 0777);
+        if (-1 == mount(data->rootfs_dev, "/mnt", "ext2", MS_RDONLY, NULL)) {
+            PERROR("Couldn't mount filesystem");
+            return -1;
+        }
+        for (i = 0; i < nslots; i++) {
+            if (slots[i].result != EXT2_UNREADABLE)
+                continue;
+            snprintf(paths[nretry], sizeof(paths[nretry]), "/mnt%s",
+                     slots[i].file);
+            retry[nretry] = slots[i];
+            retry[nretry].file = paths[nretry];
+            retry[nretry].fs_dev = NULL;
+            nretry++;
+        }
+        write_config_slots(&ca, data->config_dev, retry, nretry);
+        for (i = 0; i < nretry; i++) {
+            int j;
+            for (j = 0; j < nslots; j++)
+                if (!strcmp(slots[j].name, retry[i].name))
+                    slots[j].result = retry[i].result;
+        }
         umount("/mnt");
-        close(fd);
-        return -1;
     }
 
-    if (-1 == write_file_to_config_area("/mnt/boot/zImage", "krnA", &ca, fd)) {
+    /* Without a kernel the device won't boot; the rest is nice to have */
+    if (slots[0].result) {
         ERROR("Couldn't write kernel");
-        close(fd);
-        umount("/mnt");
         return -1;
     }
-    
-    if (-1 == write_file_to_config_area("/mnt/boot/logo-preparing.raw.gz", "logo", &ca, fd)) {
+    if (slots[1].result)
+        NOTE("Couldn't write backup kernel, but error is nonfatal");
+    if (slots[2].result)
         NOTE("Couldn't write new logo, but error is nonfatal");
-    }
-    
-
-    close(fd);
-    umount("/mnt");
     return 0;
 }
 
 static int
-download_progress(void *_data, int current)
+download_progress(void *_data, struct unpack_progress *p)
 {
     struct recovery_data *data = _data;
-    struct progress *progress = data->scene->elements[2].data;
     static int last_percentage = 0;
-    int ds = data->data_size;
+    off_t ds = data->data_size;
     int percentage;
 
-    if (!ds)
+    if (ds <= 0)
         ds = 1;
-    if (current < (data->last_data_size + 32768))
+    if (p->compressed < (data->last_data_size + 32768))
         return 0;
-    percentage = (current>>8)*100/(ds>>8);
+    percentage = p->compressed * 100 / ds;
+    if (percentage > 100)
+        percentage = 100;
 
     if (percentage != last_percentage)
-        NOTE("Download progress: %d%% (%d/%d)",
-            percentage, current, data->data_size);
+        NOTE("Download progress: %d%% (%lld/%lld, %lld unpacked, "
+             "%u KiB/s in, %u KiB/s out)",
+            percentage, (long long)p->compressed, (long long)data->data_size,
+            (long long)p->uncompressed, p->in_rate >> 10, p->out_rate >> 10);
     last_percentage = percentage;
 
-    set_progress(progress, percentage);
-    redraw_scene(data);
-    data->last_data_size = current;
+    if (!data->headless) {
+        set_progress(data->scene->elements[2].data, percentage);
+        redraw_scene(data);
+    }
+    data->last_data_size = p->compressed;
     return 0;
 }
 
 static int
-do_download(struct recovery_data *data)
+delta_progress(void *_data, off_t done, off_t total)
 {
-    FILE *in;
-    int out;
-    int ret;
-
-    redraw_scene(data);
+    struct recovery_data *data = _data;
+    struct unpack_progress p;
 
-    ret = prepare_partitions();
-    if (ret == -6) {
-        NOTE("Simulation mode detected");
-    }
-    else if (ret) {
-        ERROR("Unable to prepare disk: %d", ret);
-        move_to_scene(data, UNRECOVERABLE);
-    }
+    data->data_size = total;
+    p.compressed = p.uncompressed = done;
+    p.in_rate = p.out_rate = 0;
+    return download_progress(data, &p);
+}
 
+static int
+write_image(struct recovery_data *data, const char *dev, int flags)
+{
+    FILE *in;
+    struct blk_writer *out;
+    int ret;
 
-    if (ret == -6)
-        out = open("output.bin", O_WRONLY | O_CREAT, 0777);
-    else
-        out = open("/dev/mmcblk0p2", O_WRONLY);
-    if (-1 == out) {
+    out = open_blk_writer(dev, flags, 0);
+    if (!out) {
         PERROR("Unable to open output file for compression");
         move_to_scene(data, UNRECOVERABLE);
         return -1;
     }
 
-    in = start_wget(IMAGE_URL, &data->data_size);
-    if (in <= 0) {
+    /* Found on a USB stick at startup, or else the network.  Only a
+     * card that's being recovered has room set aside for a copy. */
+    if (!data->source.stream
+     && open_http_source(&data->source, data->image_url,
+                         data->output || data->sim ? NULL : data->card)) {
         PERROR("Couldn't wget");
         move_to_scene(data, UNRECOVERABLE);
         return -1;
     }
+    in = data->source.stream;
+    data->data_size = data->source.size;
     if (!data->data_size) {
         ERROR("Data size was reported as 0 bytes!");
         data->data_size = 1;
@@ -451,20 +504,132 @@ do_download(struct recovery_data *data)
         return -1;
     }
     else
-        NOTE("Doing download.  Data size is %d bytes", data->data_size);
+        NOTE("Doing download.  Data size is %lld bytes",
+            (long long)data->data_size);
+
+    /*
+     * Only once there's an image to write: clear the partition, so the
+     * card programs erased blocks and the image's empty stretches
+     * needn't be written at all.
+     */
+    NOTE("Preparing %s", dev);
+    trace_begin("flash", "prepare");
+    if (blk_prepare(out, 0))
+        NOTE("Writing every block of %s", dev);
+    trace_end("flash", "prepare");
+
+    /*
+     * Reading, inflating and writing each get a thread, so the network,
+     * the CPU and the card are all kept busy at once, and a published
+     * SHA-256 is checked on a thread of its own as the image goes by.
+     */
+    trace_begin("flash", "write_image");
+    if (!data->source.is_gzip)
+        NOTE("Image isn't gzipped, writing it out raw");
+    ret = run_pipeline(in, data->source.is_gzip,
+                       data->source.has_sha256 ? data->source.sha256 : NULL,
+                       out, download_progress, data);
+    if (close_blk_writer(out))
+        ret = -1;
+    data->source.bad = ret == PIPELINE_BAD_DIGEST;
+    close_source(&data->source);
+    trace_end("flash", "write_image");
+    if (ret) {
+        ERROR("Unable to write the image to %s", dev);
+        move_to_scene(data, UNRECOVERABLE);
+    }
+    return ret;
+}
+
+static int
+do_download(struct recovery_data *data)
+{
+    struct recovery_plan plan;
+    const char *dev, *manifest;
+    int ret, repartitioned;
 
-    ret = unpack_gz_stream(in, out, download_progress, data);
-    close(out);
-    fclose(in);
+    redraw_scene(data);
 
-    /* Attempt to restore the kernel */
-    NOTE("Attempting to restore kernel...");
-    if (restore_kernel(data)) {
-        ERROR("Kernel restoration failed");
+    /* An output file is written as in simulation mode */
+    start_stage(data, "partition");
+    ret = data->output ? -6 : data->sim ? 0 : prepare_partitions(data->card);
+    repartitioned = ret == 1;
+    if (repartitioned)
+        ret = 0;
+    if (ret == -6) {
+        NOTE("Simulation mode detected");
+    }
+    else if (data->sim) {
+        NOTE("Emulated card: %s and %s", data->config_dev, data->rootfs_dev);
+    }
+    else if (ret) {
+        ERROR("Unable to prepare disk: %d", ret);
+        move_to_scene(data, UNRECOVERABLE);
+        return -1;
+    }
+
+    /*
+     * Look the card over first, and only do what would change something.
+     * A card that's only partly damaged just needs its bad blocks put
+     * back.  An image on a USB stick is written out whole, as it's
+     * quicker than checking the card against the network, and so is a
+     * rootfs whose partition has only just been made.
+     */
+    dev = ret == -6 ? (data->output ? data->output : "output.bin")
+                    : data->rootfs_dev;
+    manifest = config_get("delta_manifest");
+    /* Another image's manifest would describe the wrong blocks */
+    if (!manifest && !strcmp(data->image_url, IMAGE_URL))
+        manifest = MANIFEST_URL;
+    if (data->source.stream || (manifest && !strcmp(manifest, "off")))
+        manifest = NULL;
+    data->last_data_size = 0;
+    start_stage(data, "plan");
+    plan_recovery(&plan, data->config_dev, repartitioned ? NULL : dev,
+                  manifest, delta_progress, data);
+    end_stage(data, plan.have_delta ? plan.delta.length : 0);
+    if (!plan.config_ok && ret != -6) {
+        ERROR("No usable config area to restore the kernel into");
+        free_recovery_plan(&plan);
         move_to_scene(data, UNRECOVERABLE);
         return -1;
     }
 
+    if (plan.write_rootfs) {
+        data->last_data_size = 0;
+        start_stage(data, "flash");
+        if (data->source.stream || !plan.have_delta
+         || apply_delta(&plan.delta, dev, delta_progress, data)) {
+            if (plan.have_delta)
+                NOTE("Writing out the whole image instead");
+            data->last_data_size = 0;
+            if (write_image(data, dev, ret == -6 ? O_CREAT : 0)) {
+                free_recovery_plan(&plan);
+                return -1;
+            }
+            end_stage(data, data->data_size);
+        }
+        else
+            end_stage(data, plan.delta.bad);
+    }
+    report_wget_stats();
+    free_recovery_plan(&plan);
+
+    /* Attempt to restore the kernel */
+    if (ret == -6)
+        NOTE("Simulation mode: leaving the kernel alone");
+    else if (!plan.write_kernels)
+        NOTE("Kernel slots already match the image");
+    else {
+        start_stage(data, "kernel");
+        NOTE("Attempting to restore kernel...");
+        if (restore_kernel(data)) {
+            ERROR("Kernel restoration failed");
+            move_to_scene(data, UNRECOVERABLE);
+            return -1;
+        }
+    }
+
 
     NOTE("Finished restoration");
     move_to_scene(data, DONE);
@@ -488,8 +653,11 @@ establish_connection(struct recovery_data *data)
 
     redraw_scene(data);
 
+    start_stage(data, "connect");
+    trace_begin("net", "associate");
     process = start_wpa(data->ssid, data->encryption_type==ENC_WPA ? data->key : NULL, data->ifname);
     if (!process) {
+        trace_end("net", "associate");
         fprintf(stderr, "Couldn't start WPA\n");
         move_to_scene(data, SELECT_ENCRYPTION);
         return -1;
@@ -498,6 +666,7 @@ establish_connection(struct recovery_data *data)
     do {
         ret = poll_wpa(process, 0);
     } while (!ret);
+    trace_end("net", "associate");
 
 
     if (ret < 0) {
@@ -512,8 +681,11 @@ establish_connection(struct recovery_data *data)
             ERROR("Connection error: %d", data->dhcpc_pid);
             move_to_scene(data, CONNECTION_ERROR);
         }
-        NOTE("Connected!");
-        move_to_scene(data, CONNECTED);
+        else {
+            NOTE("Connected!");
+            end_stage(data, 0);
+            move_to_scene(data, CONNECTED);
+        }
     }
 
     redraw_scene(data);
@@ -532,12 +704,14 @@ static int my_init_module(char *path) {
         PERROR("Unable to open module");
         return -1;
     }
+    trace_begin("boot", path + strlen("/modules/"));
     fstat(fd, &st);
 
     char dat[st.st_size];
     if (read(fd, dat, sizeof(dat)) != sizeof(dat)) {
         PERROR("Couldn't read");
         close(fd);
+        trace_end("boot", path + strlen("/modules/"));
         return -2;
     }
     close(fd);
@@ -545,20 +719,14 @@ static int my_init_module(char *path) {
     ret = init_module(dat, sizeof(dat), "");
     if (ret)
         PERROR("Unable to load module");
+    trace_end("boot", path + strlen("/modules/"));
     return ret;
 }
 
 
-static int
-run_ap_scan(struct recovery_data *data)
+static void
+find_interface(struct recovery_data *data)
 {
-    struct picker *picker = data->scene->elements[0].data;
-    struct textbox *textbox = data->scene->elements[1].data;
-    int i;
-
-    clear_picker(picker);
-    set_label_textbox(textbox, "Scanning for networks...");
-    redraw_scene(data);
     if (!my_ifup("wlan0"))
         data->ifname = "wlan0";
     else if (!my_ifup("wlan1"))
@@ -568,7 +736,22 @@ run_ap_scan(struct recovery_data *data)
     else if (!my_ifup("wlan3"))
         data->ifname = "wlan3";
     NOTE("Found interface %s", data->ifname);
+}
+
+static int
+run_ap_scan(struct recovery_data *data)
+{
+    struct picker *picker = data->scene->elements[0].data;
+    struct textbox *textbox = data->scene->elements[1].data;
+    int i;
+
+    clear_picker(picker);
+    set_label_textbox(textbox, "Scanning for networks...");
+    redraw_scene(data);
+    trace_begin("net", "ap_scan");
+    find_interface(data);
     data->aps = ap_scan(data->ifname);
+    trace_end("net", "ap_scan");
 
     clear_picker(picker);
     for (i=0; data->aps && data->aps[i].populated; i++) {
@@ -623,12 +806,17 @@ process_key(struct recovery_data *data, int sym)
 static int
 redraw_scene(struct recovery_data *data)
 {
+    char message[DEBUG_MESSAGE_SIZE];
     int i;
 
+    if (data->headless)
+        return 0;
     SDL_FillRect(data->screen, NULL, 0);
     for (i=0; i<data->scene->num_elements; i++)
         data->scene->elements[i].draw(data->scene->elements[i].data, data->screen);
-    set_label_textbox(debug_textbox, current_debug_message);
+    /* Other threads may be logging a new one */
+    get_debug_message(message, sizeof(message));
+    set_label_textbox(debug_textbox, message);
     redraw_textbox(debug_textbox, data->screen);
     SDL_Flip(data->screen);
 
@@ -639,6 +827,18 @@ static int
 move_to_scene(struct recovery_data *data, int scene)
 {
     int i;
+
+    data->state = scene;
+
+    /* The run's over, one way or the other */
+    if (scene == DONE || scene == UNRECOVERABLE) {
+        report_timings(data);
+        trace_instant("scene", scene == DONE ? "done" : "unrecoverable");
+        trace_finish();
+    }
+    if (data->headless)
+        return 1;
+
     for (i=0;
          i<sizeof(data->scenes)/sizeof(data->scenes[0]);
          i++) {
@@ -1100,6 +1300,302 @@ static int poll_inputs(FILE *f1, FILE *f2) {
 }
 */
 
+static void
+load_modules(void)
+{
+    NOTE("Running udev...");
+    udev_main();
+
+    NOTE("Loading modules...");
+    trace_begin("boot", "modules");
+    my_init_module("/modules/compat_firmware_class.ko");
+    my_init_module("/modules/compat.ko");
+    my_init_module("/modules/rfkill_backport.ko");
+    my_init_module("/modules/cfg80211.ko");
+    my_init_module("/modules/ath.ko");
+    my_init_module("/modules/ath9k_hw.ko");
+    my_init_module("/modules/ath9k_common.ko");
+    my_init_module("/modules/mac80211.ko");
+    my_init_module("/modules/ath9k_htc.ko");
+    trace_end("boot", "modules");
+}
+
+/* A card is partitioned, and its partitions are named after it
+ * (mmcblk0p1, loop0p1, sda1); anything else is an image file */
+static void
+set_target(struct recovery_data *data, const char *target)
+{
+    const char *sep = isdigit(target[strlen(target) - 1]) ? "p" : "";
+    struct stat st;
+
+    if (stat(target, &st) || !S_ISBLK(st.st_mode)) {
+        data->output = target;
+        return;
+    }
+    data->card = target;
+    snprintf(data->config_dev, sizeof(data->config_dev), "%s%s1",
+             target, sep);
+    snprintf(data->rootfs_dev, sizeof(data->rootfs_dev), "%s%s2",
+             target, sep);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-c config] [-H [-i url|path] [-s ssid [-k psk] | -N]\n"
+        "          [-t device|file]] [-S scenarios -i image]\n"
+        "  -c  read settings from config instead of " RECOVERY_CONFIG_FILE "\n"
+        "  -H  recover without a display, then exit\n"
+        "  -i  image to flash (default: USB storage, then the network)\n"
+        "  -s  network to join, with -k for its WPA passphrase\n"
+        "  -N  don't bring up the network\n"
+        "  -t  card to recover, or a file to write the image to\n"
+        "  -S  time a recovery of image from a simulated server onto a\n"
+        "      simulated card, for each network in the scenarios file\n"
+        "The headless_* settings in the config file stand in for these.\n",
+        name);
+}
+
+/*
+ * Headless settings come from the command line, or else from the
+ * config file: "headless = 1", and headless_image, headless_ssid,
+ * headless_psk, headless_network = off and headless_target.
+ */
+static int
+parse_args(struct recovery_data *data, int argc, char **argv)
+{
+    const char *image = NULL, *target = NULL, *setting;
+    int opt, network = 1;
+
+    while ((opt = getopt(argc, argv, "c:Hi:s:k:Nt:S:")) != -1) {
+        switch (opt) {
+            case 'c': set_config_file(optarg); break;
+            case 'H': data->headless = 1; break;
+            case 'i': image = optarg; break;
+            case 's': set_ssid(data, optarg); break;
+            case 'k': set_key(data, optarg); break;
+            case 'N': network = 0; break;
+            case 't': target = optarg; break;
+            case 'S': data->scenarios = optarg; data->headless = 1; break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    /* Nameservers other than the ones DHCP wrote down */
+    setting = config_get("resolv_conf");
+    if (setting)
+        set_dns_config(setting);
+
+    setting = config_get("headless");
+    if (setting && strtol(setting, NULL, 0))
+        data->headless = 1;
+    if (!image)
+        image = config_get("headless_image");
+    if (!data->ssid && (setting = config_get("headless_ssid")))
+        set_ssid(data, (char *)setting);
+    if (!data->key && (setting = config_get("headless_psk")))
+        set_key(data, (char *)setting);
+    setting = config_get("headless_network");
+    if (setting && !strcmp(setting, "off"))
+        network = 0;
+    if (!target)
+        target = config_get("headless_target");
+
+    /* The image is served, rather than read, in simulations */
+    if (data->scenarios) {
+        if (!image) {
+            usage(argv[0]);
+            return -1;
+        }
+        data->image_url = image;
+        return 0;
+    }
+
+    data->image_url = IMAGE_URL;
+    set_target(data, target ? target : CARD_DEVICE);
+    if (!data->card) {
+        /* Only the card's partitions hold a config area */
+        data->card = CARD_DEVICE;
+        strcpy(data->config_dev, "/dev/mmcblk0p1");
+        strcpy(data->rootfs_dev, "/dev/mmcblk0p2");
+    }
+    data->offline = !network;
+
+    if (image && strstr(image, "://"))
+        data->image_url = image;
+    else if (image && open_local_source(&data->source, image)) {
+        ERROR("Unable to open %s", image);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The same stages the scenes go through, one after the other, with how
+ * long each took printed at the end.  Returns the exit status.
+ */
+static int
+run_headless(struct recovery_data *data)
+{
+    trace_init();
+    NOTE("Running headless");
+
+    start_stage(data, "source");
+    if (!data->source.stream && !data->sim
+     && !find_usb_image(&data->source))
+        NOTE("Using the image on USB storage");
+    end_stage(data, 0);
+
+    if (data->sim) {
+        start_stage(data, "connect");
+        sim_connect(data->sim);
+    }
+    else if (!data->source.stream && !data->offline) {
+        if (!data->ssid) {
+            ERROR("There's no network to join: give one, or -N");
+            move_to_scene(data, UNRECOVERABLE);
+            return 1;
+        }
+        start_stage(data, "modules");
+        load_modules();
+        start_stage(data, "interface");
+        find_interface(data);
+        if (!data->ifname) {
+            ERROR("No wireless interface came up");
+            move_to_scene(data, UNRECOVERABLE);
+            return 1;
+        }
+        data->encryption_type = data->key ? ENC_WPA : ENC_OPEN;
+        establish_connection(data);
+        if (data->state != CONNECTED) {
+            ERROR("Unable to connect to %s", data->ssid);
+            move_to_scene(data, UNRECOVERABLE);
+            return 1;
+        }
+    }
+
+    do_download(data);
+    printf("result=%s\n", data->state == DONE ? "done" : "failed");
+    return data->state == DONE ? 0 : 1;
+}
+
+/*
+ * Runs a headless recovery for each scenario, from a server in this
+ * process onto a card made of files in sim_dir (default /tmp), and
+ * prints how each went.  The server's name is looked up through a
+ * nameserver in this process too.  Each run gets a trace of its own,
+ * in trace_file with the scenario's name added.  Returns the exit
+ * status.
+ */
+static int
+run_simulation(struct recovery_data *data)
+{
+    struct sim_scenario scenarios[SIM_MAX_SCENARIOS];
+    struct {
+        int ok;
+        unsigned long long ms;
+        unsigned long long flash_kib_s;
+    } results[SIM_MAX_SCENARIOS];
+    static char resolv_conf[256];
+    char root[256], url[512], trace_path[512];
+    const char *image = data->image_url, *base, *dir, *trace_file;
+    int count, port, dns_port, i, stem = 0, failed = 0;
+    FILE *f;
+
+    count = load_sim_scenarios(data->scenarios, scenarios,
+                               SIM_MAX_SCENARIOS);
+    if (count <= 0) {
+        ERROR("No scenarios in %s", data->scenarios);
+        return 1;
+    }
+    dir = config_get("sim_dir");
+    if (!dir)
+        dir = "/tmp";
+
+    base = strrchr(image, '/');
+    if (base)
+        snprintf(root, sizeof(root), "%.*s", (int)(base - image), image);
+    else
+        strcpy(root, ".");
+    base = base ? base + 1 : image;
+    port = start_sim_server(root);
+    dns_port = start_sim_dns();
+    if (port < 0 || dns_port < 0)
+        return 1;
+    snprintf(url, sizeof(url), "http://" SIM_HOST ":%d/%s", port, base);
+
+    snprintf(resolv_conf, sizeof(resolv_conf), "%s/resolv.conf", dir);
+    f = fopen(resolv_conf, "w");
+    if (!f) {
+        PERROR("Unable to write %s", resolv_conf);
+        return 1;
+    }
+    fprintf(f, "nameserver 127.0.0.1#%d\n", dns_port);
+    fclose(f);
+    set_dns_config(resolv_conf);
+
+    /* Every run has to fetch the whole image */
+    config_set("image_cache", "off");
+
+    trace_file = config_get("trace_file");
+    if (trace_file) {
+        stem = strlen(trace_file);
+        if (stem > 5 && !strcmp(trace_file + stem - 5, ".json"))
+            stem -= 5;
+    }
+
+    for (i = 0; i < count; i++) {
+        unsigned long long start;
+        int j;
+
+        NOTE("Scenario %s", scenarios[i].name);
+        printf("scenario=%s\n", scenarios[i].name);
+        bzero(&data->source, sizeof(data->source));
+        data->nstages = 0;
+        data->state = 0;
+        data->data_size = 0;
+        data->output = NULL;
+        data->image_url = url;
+        data->sim = &scenarios[i];
+        if (make_sim_card(dir, SIM_ROOTFS_SIZE, data->config_dev,
+                          data->rootfs_dev, sizeof(data->config_dev)))
+            return 1;
+        set_sim_scenario(&scenarios[i]);
+
+        trace_reset();
+        if (trace_file) {
+            snprintf(trace_path, sizeof(trace_path), "%.*s-%s.json",
+                     stem, trace_file, scenarios[i].name);
+            config_set("trace_file", trace_path);
+        }
+
+        start = monotonic_us();
+        results[i].ok = !run_headless(data);
+        results[i].ms = (monotonic_us() - start) / 1000;
+        results[i].flash_kib_s = 0;
+        for (j = 0; j < data->nstages; j++)
+            if (!strcmp(data->stages[j].name, "flash") && data->stages[j].us)
+                results[i].flash_kib_s = (data->stages[j].bytes * 1000000ULL
+                                          / data->stages[j].us) >> 10;
+        if (!results[i].ok)
+            failed++;
+
+        /* Don't carry connections over to the next network */
+        close_wget_pool();
+    }
+
+    printf("%-20s %8s %10s %12s\n", "scenario", "result", "ms", "flash KiB/s");
+    for (i = 0; i < count; i++)
+        printf("%-20s %8s %10llu %12llu\n", scenarios[i].name,
+               results[i].ok ? "done" : "failed", results[i].ms,
+               results[i].flash_kib_s);
+    fflush(stdout);
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
     struct recovery_data data;
     SDL_Event e;
@@ -1112,6 +1608,9 @@ int main(int argc, char **argv) {
          0xff&(RECOVERY_VERSION>>8 ),
          0xff&(RECOVERY_VERSION>>0 ));
 
+    if (parse_args(&data, argc, argv))
+        return 1;
+
     signal(SIGTERM, sig_handle);
     signal(SIGHUP, sig_handle);
     signal(SIGALRM, sig_handle);
@@ -1126,9 +1625,12 @@ int main(int argc, char **argv) {
 #endif
 
     bzero(&e, sizeof(e));
-    bzero(&data, sizeof(data));
 
     data.should_quit = 0;
+    if (data.scenarios)
+        return run_simulation(&data);
+    if (data.headless)
+        return run_headless(&data);
 
     NOTE("Initializing SDL...");
     if (SDL_Init(SDL_INIT_TIMER | SDL_INIT_VIDEO)) {
@@ -1144,19 +1646,11 @@ int main(int argc, char **argv) {
 
     SDL_ShowCursor(SDL_DISABLE);
 
-    NOTE("Running udev...");
-    udev_main();
-
-    NOTE("Loading modules...");
-    my_init_module("/modules/compat_firmware_class.ko");
-    my_init_module("/modules/compat.ko");
-    my_init_module("/modules/rfkill_backport.ko");
-    my_init_module("/modules/cfg80211.ko");
-    my_init_module("/modules/ath.ko");
-    my_init_module("/modules/ath9k_hw.ko");
-    my_init_module("/modules/ath9k_common.ko");
-    my_init_module("/modules/mac80211.ko");
-    my_init_module("/modules/ath9k_htc.ko");
+    /* Before udev forks, so its firmware loads get traced too */
+    trace_init();
+    start_stage(&data, "modules");
+    load_modules();
+    end_stage(&data, 0);
 
     NOTE("Setting up scenes...");
     setup_scenes(&data);
@@ -1169,8 +1663,16 @@ int main(int argc, char **argv) {
         return 0;
     }
 
-    NOTE("Moving to scene %d", SELECT_SSID);
-    move_to_scene(&data, SELECT_SSID);
+    /* An image on a USB stick means there's no network to set up */
+    NOTE("Looking for an image on USB storage...");
+    if (data.source.stream || !find_usb_image(&data.source)) {
+        NOTE("Moving to scene %d", DOWNLOADING);
+        move_to_scene(&data, DOWNLOADING);
+    }
+    else {
+        NOTE("Moving to scene %d", SELECT_SSID);
+        move_to_scene(&data, SELECT_SSID);
+    }
     redraw_scene(&data);
 
     NOTE("Entering main loop");
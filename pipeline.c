@@ -0,0 +1,571 @@
+#define _GNU_SOURCE /* fopencookie */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "pipeline.h"
+#include "sha256.h"
+#include "trace.h"
+#include "log.h"
+#include "clock.h"
+
+/*
+ * The stages hand data along in fixed-size slots through single-producer
+ * single-consumer rings.  Each side only ever writes its own index, so
+ * the fast path is a couple of atomic loads and stores; a stage only
+ * sleeps (on a futex) when its ring is full or empty, which is what
+ * gives back-pressure.  The first ring can have a second consumer, the
+ * hasher, reading the same slots alongside the next stage; a slot is
+ * only reused once both are done with it.
+ */
+#define SLOT_SIZE   (128 * 1024)
+#define RING_SLOTS  16              /* a power of two */
+#define MAX_CONSUMERS 2
+
+/* How often the caller's progress callback runs */
+#define PROGRESS_MS 200
+
+/* Sleeps are bounded, so an abort is never missed for long */
+#define WAIT_NS     (100 * 1000000)
+
+struct ring_slot {
+    char *data;
+    size_t len;
+};
+
+struct ring {
+    struct ring_slot slot[RING_SLOTS];
+    unsigned head;              /* slots filled; written by the producer */
+    unsigned tail[MAX_CONSUMERS]; /* slots drained; each by its consumer */
+    int consumers;
+    int producer_waiting;
+    int consumers_waiting;      /* how many are asleep */
+    int closed;                 /* no more slots coming */
+    int *aborted;
+};
+
+struct pipeline;
+
+struct stage {
+    const char *name;
+    void *(*main)(void *);
+    pthread_t thread;
+    struct pipeline *p;
+    struct ring *in;
+    int consumer;               /* which of in's tails is ours */
+    struct ring *out;
+
+    /* The slots being worked on, for the inflater's stream callbacks */
+    struct ring_slot *cur_in;
+    size_t cur_in_off;
+    struct ring_slot *cur_out;
+
+    unsigned long long start_us, end_us;
+    unsigned long long starved_us;  /* waiting for input */
+    unsigned long long blocked_us;  /* waiting for room for output */
+    off_t bytes;                    /* bytes this stage has passed on */
+    int failed;
+};
+
+struct pipeline {
+    FILE *in;
+    struct blk_writer *out;
+    const unsigned char *sha256;    /* what in should hash to */
+    struct ring rings[2];
+    struct stage stages[4];
+    int nstages;
+    struct stage *reader, *writer, *hasher;
+    int aborted;
+    int bad_digest;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int running;
+};
+
+static void futex_wait(unsigned *addr, unsigned val) {
+    struct timespec timeout = { 0, WAIT_NS };
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &timeout, NULL, 0);
+}
+
+/* Both of a ring's consumers can be asleep on its head */
+static void futex_wake(unsigned *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static int is_aborted(struct ring *r) {
+    return __atomic_load_n(r->aborted, __ATOMIC_ACQUIRE);
+}
+
+/* The consumer furthest behind, which is the one that frees slots */
+static int slowest_consumer(struct ring *r) {
+    int i, slowest = 0;
+
+    for (i = 1; i < r->consumers; i++)
+        if (r->head - __atomic_load_n(&r->tail[i], __ATOMIC_ACQUIRE)
+          > r->head - __atomic_load_n(&r->tail[slowest], __ATOMIC_ACQUIRE))
+            slowest = i;
+    return slowest;
+}
+
+/* Producer: the next empty slot, waiting for one if need be.  NULL if
+ * the pipeline was aborted. */
+static struct ring_slot *ring_get_free(struct ring *r, unsigned long long *wait_us) {
+    unsigned long long start = 0;
+    unsigned tail;
+    int c;
+
+    for (;;) {
+        c = slowest_consumer(r);
+        tail = __atomic_load_n(&r->tail[c], __ATOMIC_ACQUIRE);
+        if (r->head - tail < RING_SLOTS)
+            break;
+        if (is_aborted(r))
+            return NULL;
+        if (!start)
+            start = monotonic_us();
+        __atomic_store_n(&r->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->tail[c], __ATOMIC_SEQ_CST) == tail)
+            futex_wait(&r->tail[c], tail);
+        __atomic_store_n(&r->producer_waiting, 0, __ATOMIC_RELAXED);
+    }
+    if (start)
+        *wait_us += monotonic_us() - start;
+    return &r->slot[r->head % RING_SLOTS];
+}
+
+/* Producer: hand the slot from ring_get_free() on */
+static void ring_put(struct ring *r) {
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->consumers_waiting, __ATOMIC_SEQ_CST))
+        futex_wake(&r->head);
+}
+
+static void ring_close(struct ring *r) {
+    __atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->consumers_waiting, __ATOMIC_SEQ_CST))
+        futex_wake(&r->head);
+}
+
+/* Consumer c: the next full slot, waiting for one if need be.  NULL at
+ * the end of the data, or if the pipeline was aborted. */
+static struct ring_slot *ring_get_full(struct ring *r, int c,
+                                       unsigned long long *wait_us) {
+    unsigned long long start = 0;
+    unsigned head;
+
+    for (;;) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head != r->tail[c])
+            break;
+        if (is_aborted(r))
+            return NULL;
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+            /* Anything put before the close is visible by now */
+            if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail[c])
+                return NULL;
+            continue;
+        }
+        if (!start)
+            start = monotonic_us();
+        __atomic_add_fetch(&r->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == head
+         && !__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST))
+            futex_wait(&r->head, head);
+        __atomic_sub_fetch(&r->consumers_waiting, 1, __ATOMIC_RELAXED);
+    }
+    if (start)
+        *wait_us += monotonic_us() - start;
+    return &r->slot[r->tail[c] % RING_SLOTS];
+}
+
+/* Consumer c: give the slot from ring_get_full() back */
+static void ring_release(struct ring *r, int c) {
+    __atomic_store_n(&r->tail[c], r->tail[c] + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->producer_waiting, __ATOMIC_SEQ_CST))
+        futex_wake(&r->tail[c]);
+}
+
+static void abort_pipeline(struct pipeline *p) {
+    int i, c;
+
+    __atomic_store_n(&p->aborted, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < 2; i++) {
+        futex_wake(&p->rings[i].head);
+        for (c = 0; c < MAX_CONSUMERS; c++)
+            futex_wake(&p->rings[i].tail[c]);
+    }
+}
+
+static void add_bytes(struct stage *s, size_t n) {
+    __atomic_store_n(&s->bytes, s->bytes + n, __ATOMIC_RELAXED);
+}
+
+static void stage_done(struct stage *s) {
+    struct pipeline *p = s->p;
+
+    s->end_us = monotonic_us();
+    if (s->failed)
+        abort_pipeline(p);
+    if (s->out)
+        ring_close(s->out);
+
+    pthread_mutex_lock(&p->lock);
+    p->running--;
+    pthread_cond_signal(&p->done);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Network (or USB) -> first ring.  Time spent waiting on the source
+ * counts as work: that's this stage's job. */
+static void *reader_main(void *arg) {
+    struct stage *s = arg;
+    struct ring_slot *slot;
+    size_t n;
+
+    while ((slot = ring_get_free(s->out, &s->blocked_us))) {
+        n = fread(slot->data, 1, SLOT_SIZE, s->p->in);
+        if (n) {
+            slot->len = n;
+            ring_put(s->out);
+            add_bytes(s, n);
+        }
+        if (n < SLOT_SIZE) {
+            if (ferror(s->p->in)) {
+                ERROR("Unable to read image");
+                s->failed = 1;
+            }
+            break;
+        }
+    }
+    stage_done(s);
+    return NULL;
+}
+
+/* The inflater reads its input ring as a stream... */
+static ssize_t inflate_read(void *cookie, char *buf, size_t size) {
+    struct stage *s = cookie;
+    size_t n;
+
+    if (!s->cur_in) {
+        s->cur_in = ring_get_full(s->in, s->consumer, &s->starved_us);
+        if (!s->cur_in)
+            return is_aborted(s->in) ? -1 : 0;
+        s->cur_in_off = 0;
+    }
+
+    n = s->cur_in->len - s->cur_in_off;
+    if (n > size)
+        n = size;
+    memcpy(buf, s->cur_in->data + s->cur_in_off, n);
+    s->cur_in_off += n;
+    if (s->cur_in_off == s->cur_in->len) {
+        ring_release(s->in, s->consumer);
+        s->cur_in = NULL;
+    }
+    return n;
+}
+
+/* ...and packs the windows gunzip hands it into whole output slots */
+static int inflate_put(void *dat, const void *buf, size_t len) {
+    struct stage *s = dat;
+    size_t n;
+
+    while (len) {
+        if (!s->cur_out) {
+            s->cur_out = ring_get_free(s->out, &s->blocked_us);
+            if (!s->cur_out)
+                return -1;
+            s->cur_out->len = 0;
+        }
+        n = SLOT_SIZE - s->cur_out->len;
+        if (n > len)
+            n = len;
+        memcpy(s->cur_out->data + s->cur_out->len, buf, n);
+        s->cur_out->len += n;
+        buf = (const char *)buf + n;
+        len -= n;
+        add_bytes(s, n);
+        if (s->cur_out->len == SLOT_SIZE) {
+            ring_put(s->out);
+            s->cur_out = NULL;
+        }
+    }
+    return 0;
+}
+
+static void *inflate_main(void *arg) {
+    static const cookie_io_functions_t ring_funcs = {
+        .read = inflate_read,
+    };
+    struct stage *s = arg;
+    char buf[4096];
+    FILE *in;
+
+    in = fopencookie(s, "r", ring_funcs);
+    if (!in) {
+        PERROR("Unable to create inflate stream");
+        s->failed = 1;
+        stage_done(s);
+        return NULL;
+    }
+    setvbuf(in, NULL, _IONBF, 0);
+
+    if (unpack_gz_stream_cb(in, inflate_put, s, NULL, NULL) < 0)
+        s->failed = 1;
+    else {
+        if (s->cur_out && s->cur_out->len)
+            ring_put(s->out);
+        /* Let the reader finish whatever follows the gzip trailer */
+        while (inflate_read(s, buf, sizeof(buf)) > 0)
+            ;
+    }
+    fclose(in);
+    stage_done(s);
+    return NULL;
+}
+
+/* Last ring -> output */
+static void *writer_main(void *arg) {
+    struct stage *s = arg;
+    struct ring_slot *slot;
+
+    while ((slot = ring_get_full(s->in, s->consumer, &s->starved_us))) {
+        if (blk_write(s->p->out, slot->data, slot->len)) {
+            ERROR("Unable to write image");
+            s->failed = 1;
+            break;
+        }
+        add_bytes(s, slot->len);
+        ring_release(s->in, s->consumer);
+    }
+    if (is_aborted(s->in))
+        s->failed = 1;
+    stage_done(s);
+    return NULL;
+}
+
+/*
+ * The image as read, beside the inflater (or writer) -> its SHA-256.
+ * It only reads the slots, so it costs the others nothing unless it
+ * falls a whole ring behind.  A mismatch stops the pipeline as soon
+ * as the last byte has been hashed, before the rest is written.
+ */
+static void *hasher_main(void *arg) {
+    struct stage *s = arg;
+    struct ring_slot *slot;
+    struct sha256_ctx ctx;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+
+    trace_begin("flash", "sha256");
+    sha256_init(&ctx);
+    while ((slot = ring_get_full(s->in, s->consumer, &s->starved_us))) {
+        sha256_update(&ctx, slot->data, slot->len);
+        add_bytes(s, slot->len);
+        ring_release(s->in, s->consumer);
+    }
+    if (is_aborted(s->in))
+        s->failed = 1;
+    else {
+        sha256_final(&ctx, digest);
+        if (memcmp(digest, s->p->sha256, sizeof(digest))) {
+            ERROR("Image doesn't match its published SHA-256");
+            s->p->bad_digest = 1;
+            s->failed = 1;
+        }
+        else
+            NOTE("Image matches its published SHA-256");
+    }
+    trace_end("flash", "sha256");
+    stage_done(s);
+    return NULL;
+}
+
+static void report_stages(struct pipeline *p) {
+    struct stage *slowest = NULL;
+    unsigned slowest_pct = 0;
+    int i;
+
+    for (i = 0; i < p->nstages; i++) {
+        struct stage *s = &p->stages[i];
+        unsigned long long wall = s->end_us - s->start_us + 1;
+        unsigned long long idle = s->starved_us + s->blocked_us;
+        unsigned busy = idle < wall ? (wall - idle) * 100 / wall : 0;
+
+        NOTE("pipeline_stage name=%s busy_pct=%u starved_pct=%llu "
+             "blocked_pct=%llu bytes=%lld secs=%llu.%03llu",
+            s->name, busy, s->starved_us * 100 / wall,
+            s->blocked_us * 100 / wall, (long long)s->bytes,
+            wall / 1000000, (wall / 1000) % 1000);
+        if (!slowest || busy > slowest_pct) {
+            slowest = s;
+            slowest_pct = busy;
+        }
+    }
+    if (slowest)
+        NOTE("pipeline_bottleneck name=%s busy_pct=%u",
+            slowest->name, slowest_pct);
+
+    /* Hashing only adds to the run what's left once the reading's done */
+    if (p->hasher && p->hasher < p->stages + p->nstages) {
+        struct stage *h = p->hasher;
+        unsigned long long wall = h->end_us - h->start_us;
+        unsigned long long busy = wall > h->starved_us
+                                ? wall - h->starved_us : 0;
+        unsigned long long tail = h->end_us > p->reader->end_us
+                                ? h->end_us - p->reader->end_us : 0;
+
+        NOTE("sha256_stats impl=%s bytes=%lld busy_ms=%llu "
+             "after_read_ms=%llu overlapped_pct=%llu",
+            sha256_impl(), (long long)h->bytes, busy / 1000, tail / 1000,
+            busy > tail ? (busy - tail) * 100 / busy : 0);
+    }
+}
+
+static void report_progress(struct pipeline *p, struct unpack_progress *prog,
+                            unsigned long long *last_us,
+                            int (*upd)(void *, struct unpack_progress *),
+                            void *dat) {
+    struct stage *reader = p->reader;
+    struct stage *writer = p->writer;
+    unsigned long long now = monotonic_us();
+    off_t in = __atomic_load_n(&reader->bytes, __ATOMIC_RELAXED);
+    off_t out = __atomic_load_n(&writer->bytes, __ATOMIC_RELAXED);
+
+    if (now - *last_us >= 1000000) {
+        prog->in_rate = (in - prog->compressed) * 1000000 / (now - *last_us);
+        prog->out_rate = (out - prog->uncompressed) * 1000000 / (now - *last_us);
+        *last_us = now;
+        prog->compressed = in;
+        prog->uncompressed = out;
+    }
+    if (upd) {
+        struct unpack_progress cur = *prog;
+        cur.compressed = in;
+        cur.uncompressed = out;
+        upd(dat, &cur);
+    }
+}
+
+int run_pipeline(FILE *in, int is_gzip, const unsigned char *sha256,
+                 struct blk_writer *out,
+                 int (*upd)(void *, struct unpack_progress *), void *dat) {
+    struct pipeline *p;
+    struct unpack_progress prog;
+    unsigned long long last_us;
+    int nrings = is_gzip ? 2 : 1;
+    int i, j, ret = 0;
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return -1;
+    p->in = in;
+    p->out = out;
+    p->sha256 = sha256;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (i = 0; i < nrings; i++) {
+        p->rings[i].aborted = &p->aborted;
+        for (j = 0; j < RING_SLOTS; j++) {
+            p->rings[i].slot[j].data = malloc(SLOT_SIZE);
+            if (!p->rings[i].slot[j].data) {
+                ERROR("Out of memory for pipeline buffers");
+                ret = -1;
+                goto out;
+            }
+        }
+    }
+
+    p->reader = &p->stages[p->nstages++];
+    p->reader->name = "reader";
+    p->reader->main = reader_main;
+    p->reader->out = &p->rings[0];
+    if (is_gzip) {
+        struct stage *s = &p->stages[p->nstages++];
+        s->name = "inflate";
+        s->main = inflate_main;
+        s->in = &p->rings[0];
+        s->out = &p->rings[1];
+    }
+    p->writer = &p->stages[p->nstages++];
+    p->writer->name = "writer";
+    p->writer->main = writer_main;
+    p->writer->in = &p->rings[nrings - 1];
+    for (i = 0; i < nrings; i++)
+        p->rings[i].consumers = 1;
+    if (sha256) {
+        p->hasher = &p->stages[p->nstages++];
+        p->hasher->name = "sha256";
+        p->hasher->main = hasher_main;
+        p->hasher->in = &p->rings[0];
+        p->hasher->consumer = p->rings[0].consumers++;
+    }
+
+    bzero(&prog, sizeof(prog));
+    last_us = monotonic_us();
+
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i < p->nstages; i++) {
+        struct stage *s = &p->stages[i];
+
+        s->p = p;
+        s->start_us = monotonic_us();
+        if (pthread_create(&s->thread, NULL, s->main, s)) {
+            PERROR("Unable to start %s thread", s->name);
+            abort_pipeline(p);
+            /* Earlier stages are running and will wind down */
+            p->nstages = i;
+            ret = -1;
+            break;
+        }
+        p->running++;
+    }
+
+    /* Progress is reported from here, so the callback can use SDL */
+    while (p->running) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += PROGRESS_MS * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&p->done, &p->lock, &ts);
+        if (!p->running || !p->nstages)
+            break;
+        pthread_mutex_unlock(&p->lock);
+        report_progress(p, &prog, &last_us, upd, dat);
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < p->nstages; i++) {
+        pthread_join(p->stages[i].thread, NULL);
+        if (p->stages[i].failed)
+            ret = -1;
+    }
+    if (p->nstages) {
+        report_progress(p, &prog, &last_us, upd, dat);
+        report_stages(p);
+    }
+    if (p->bad_digest)
+        ret = PIPELINE_BAD_DIGEST;
+
+ out:
+    for (i = 0; i < 2; i++)
+        for (j = 0; j < RING_SLOTS; j++)
+            free(p->rings[i].slot[j].data);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->done);
+    free(p);
+    return ret;
+}
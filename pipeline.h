@@ -0,0 +1,23 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+#include <stdio.h>
+#include "gunzip.h"
+#include "blkwrite.h"
+
+/* run_pipeline() result when in didn't hash to what it should */
+#define PIPELINE_BAD_DIGEST -2
+
+/*
+ * Copy an image from in to out with each step on its own thread:
+ * a reader pulling from in, an inflater (gzipped images only) and a
+ * writer pushing to out.  If sha256 isn't NULL, a hasher checks in
+ * against it alongside them.  upd is called from the calling thread, a
+ * few times a second, so it's free to touch the UI.
+ *
+ * Returns 0 once everything has been written, PIPELINE_BAD_DIGEST if in
+ * didn't match sha256, or -1 if any other stage failed.
+ */
+int run_pipeline(FILE *in, int is_gzip, const unsigned char *sha256,
+                 struct blk_writer *out,
+                 int (*upd)(void *, struct unpack_progress *), void *dat);
+#endif /* __PIPELINE_H__ */
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "config-area.h"
+#include "planner.h"
+#include "sha256.h"
+#include "log.h"
+
+/* Slots are read this much at a time */
+#define SLOT_READ_SIZE (256 * 1024)
+
+/* Does the block named by slot start with what the manifest says? */
+static int slot_matches(const char *dev, struct config_area_index *ca,
+                        struct delta_slot *slot) {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    struct sha256_ctx ctx;
+    struct block_def *bd;
+    char *buf;
+    off_t done = 0;
+    int fd;
+
+    bd = find_config_block(ca, slot->name);
+    if (!bd || slot->length > bd->length) {
+        NOTE("Config area has no room for %s", slot->name);
+        return 0;
+    }
+    fd = open(dev, O_RDONLY);
+    if (fd == -1) {
+        PERROR("Unable to open %s", dev);
+        return 0;
+    }
+    buf = malloc(SLOT_READ_SIZE);
+    if (!buf) {
+        close(fd);
+        return 0;
+    }
+
+    sha256_init(&ctx);
+    while (done < slot->length) {
+        size_t len = slot->length - done < SLOT_READ_SIZE
+                   ? slot->length - done : SLOT_READ_SIZE;
+        ssize_t got = pread(fd, buf, len, (off_t)bd->offset + done);
+        if (got <= 0) {
+            PERROR("Unable to read %s", slot->name);
+            break;
+        }
+        sha256_update(&ctx, buf, got);
+        done += got;
+    }
+    sha256_final(&ctx, digest);
+    free(buf);
+    close(fd);
+
+    if (done < slot->length || memcmp(digest, slot->sha256, sizeof(digest))) {
+        NOTE("%s differs from the image", slot->name);
+        return 0;
+    }
+    return 1;
+}
+
+void plan_recovery(struct recovery_plan *plan, const char *config_dev,
+                   const char *rootfs, const char *manifest_url,
+                   int (*upd)(void *, off_t done, off_t total), void *dat) {
+    struct config_area_index ca;
+    int i;
+
+    bzero(plan, sizeof(*plan));
+    plan->write_rootfs = 1;
+    plan->write_kernels = 1;
+
+    plan->config_ok = !read_config_area(config_dev, &ca);
+    if (plan->config_ok)
+        NOTE("Config area: last update %.16s%s", ca.ca.last_update,
+            ca.ca.updating[0] ? ", which didn't finish" : "");
+
+    if (manifest_url && !open_delta(&plan->delta, manifest_url)) {
+        plan->have_delta = 1;
+        if (plan->delta.version[0])
+            NOTE("Image is version %s", plan->delta.version);
+
+        /* A freshly partitioned card, say, has nothing worth keeping */
+        if (!rootfs) {
+            NOTE("Rootfs needs writing whole, not checking it");
+            plan->delta.bad = plan->delta.length;
+        }
+        else if (!check_delta(&plan->delta, rootfs, upd, dat))
+            plan->write_rootfs = plan->delta.bad != 0;
+
+        /* Every slot the manifest vouches for has to match */
+        if (plan->config_ok && plan->delta.nslots) {
+            plan->write_kernels = 0;
+            for (i = 0; i < plan->delta.nslots; i++)
+                if (!slot_matches(config_dev, &ca, &plan->delta.slots[i]))
+                    plan->write_kernels = 1;
+        }
+    }
+
+    NOTE("Plan: %s the rootfs, %s the kernels",
+        plan->write_rootfs ? "write" : "keep",
+        plan->write_kernels ? "restore" : "keep");
+}
+
+void free_recovery_plan(struct recovery_plan *plan) {
+    if (plan->have_delta)
+        close_delta(&plan->delta);
+    plan->have_delta = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef __PLANNER_H__
+#define __PLANNER_H__
+#include <sys/types.h>
+#include "delta.h"
+
+/*
+ * What a recovery actually has to do.  The card is looked over before
+ * anything is written, and only the steps that would change something
+ * are carried out.
+ */
+struct recovery_plan {
+    int config_ok;          /* there's a config area to put kernels in */
+    int write_rootfs;       /* it differs from the image, or wasn't checked */
+    int write_kernels;      /* a slot differs, or wasn't checked */
+
+    /* The image's manifest, and which blocks of the rootfs differ */
+    int have_delta;
+    struct delta delta;
+};
+
+/* Check the config area on config_dev, then the rootfs and the kernel
+ * slots against the manifest at manifest_url (if it's not NULL).  A NULL
+ * rootfs is one that's known to need writing whole.  upd() hears how
+ * far through the rootfs the check is. */
+void plan_recovery(struct recovery_plan *plan, const char *config_dev,
+                   const char *rootfs, const char *manifest_url,
+                   int (*upd)(void *, off_t done, off_t total), void *dat);
+
+void free_recovery_plan(struct recovery_plan *plan);
+#endif /* __PLANNER_H__ */
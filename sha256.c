@@ -0,0 +1,224 @@
+#include <string.h>
+#include "sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI
+#endif
+
+/* FIPS 180-4 */
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *state, const unsigned char *p) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++, p += 4)
+        w[i] = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    for (; i < 64; i++) {
+        uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g))
+           + k[i] + w[i];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_blocks_portable(uint32_t *state, const unsigned char *p,
+                                   size_t n) {
+    for (; n; n--, p += 64)
+        sha256_block(state, p);
+}
+
+#ifdef HAVE_SHA_NI
+/*
+ * The SHA extensions do two rounds an instruction, on the state split
+ * into ABEF and CDGH halves, and most of the message schedule too.
+ */
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha256_blocks_shani(uint32_t *state, const unsigned char *p,
+                                size_t n) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL);
+    __m128i abef, cdgh, t, w[4];
+    int i;
+
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    abef = _mm_alignr_epi8(t, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, t, 0xf0);
+
+    for (; n; n--, p += 64) {
+        __m128i abef_in = abef, cdgh_in = cdgh;
+
+        for (i = 0; i < 4; i++)
+            w[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i *)(p + 16 * i)), bswap);
+
+        /* Four rounds a pass, while working out the words four on */
+        for (i = 0; i < 16; i++) {
+            t = _mm_add_epi32(w[i & 3],
+                              _mm_loadu_si128((const __m128i *)&k[4 * i]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, t);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh,
+                                         _mm_shuffle_epi32(t, 0x0e));
+            if (i < 12) {
+                t = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                t = _mm_add_epi32(t, _mm_alignr_epi8(w[(i + 3) & 3],
+                                                     w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(t, w[(i + 3) & 3]);
+            }
+        }
+        abef = _mm_add_epi32(abef, abef_in);
+        cdgh = _mm_add_epi32(cdgh, cdgh_in);
+    }
+
+    t = _mm_shuffle_epi32(abef, 0x1b);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(t, cdgh, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, t, 8));
+}
+
+static int have_sha_ni(void) {
+    unsigned a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)
+     || !(c & bit_SSSE3) || !(c & bit_SSE4_1))
+        return 0;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        return 0;
+    return !!(b & (1 << 29));
+}
+#endif
+
+typedef void (*blocks_fn)(uint32_t *, const unsigned char *, size_t);
+
+static void pick_blocks(uint32_t *state, const unsigned char *p, size_t n);
+
+/* Set on first use to the fastest the CPU can run */
+static blocks_fn sha256_blocks = pick_blocks;
+static const char *blocks_name;
+
+static blocks_fn best_blocks(void) {
+#ifdef HAVE_SHA_NI
+    if (have_sha_ni()) {
+        blocks_name = "sha-ni";
+        return sha256_blocks_shani;
+    }
+#endif
+    blocks_name = "portable";
+    return sha256_blocks_portable;
+}
+
+static void pick_blocks(uint32_t *state, const unsigned char *p, size_t n) {
+    blocks_fn blocks = best_blocks();
+
+    __atomic_store_n(&sha256_blocks, blocks, __ATOMIC_RELEASE);
+    blocks(state, p, n);
+}
+
+const char *sha256_impl(void) {
+    if (!blocks_name)
+        __atomic_store_n(&sha256_blocks, best_blocks(), __ATOMIC_RELEASE);
+    return blocks_name;
+}
+
+void sha256_init(struct sha256_ctx *ctx) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->length = 0;
+    ctx->buf_len = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    ctx->length += len;
+    if (ctx->buf_len) {
+        size_t n = sizeof(ctx->buf) - ctx->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + ctx->buf_len, p, n);
+        ctx->buf_len += n;
+        p += n;
+        len -= n;
+        if (ctx->buf_len < sizeof(ctx->buf))
+            return;
+        sha256_block(ctx->state, ctx->buf);
+        ctx->buf_len = 0;
+    }
+    if (len >= 64) {
+        blocks_fn blocks = __atomic_load_n(&sha256_blocks, __ATOMIC_ACQUIRE);
+        blocks(ctx->state, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(ctx->buf, p, len);
+    ctx->buf_len = len;
+}
+
+void sha256_final(struct sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->length * 8;
+    int i;
+
+    ctx->buf[ctx->buf_len++] = 0x80;
+    if (ctx->buf_len > 56) {
+        memset(ctx->buf + ctx->buf_len, 0, sizeof(ctx->buf) - ctx->buf_len);
+        sha256_block(ctx->state, ctx->buf);
+        ctx->buf_len = 0;
+    }
+    memset(ctx->buf + ctx->buf_len, 0, 56 - ctx->buf_len);
+    for (i = 0; i < 8; i++)
+        ctx->buf[56 + i] = bits >> (56 - 8 * i);
+    sha256_block(ctx->state, ctx->buf);
+
+    for (i = 0; i < 8; i++) {
+        digest[4 * i]     = ctx->state[i] >> 24;
+        digest[4 * i + 1] = ctx->state[i] >> 16;
+        digest[4 * i + 2] = ctx->state[i] >> 8;
+        digest[4 * i + 3] = ctx->state[i];
+    }
+}
+
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_SIZE]) {
+    struct sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
@@ -0,0 +1,24 @@
+#ifndef __SHA256_H__
+#define __SHA256_H__
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;        /* bytes hashed so far */
+    unsigned char buf[64];
+    unsigned buf_len;
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+/* Which code hashes whole blocks on this CPU, for the logs */
+const char *sha256_impl(void);
+
+/* All three at once */
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_SIZE]);
+#endif /* __SHA256_H__ */
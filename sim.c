@@ -0,0 +1,536 @@
+#define _GNU_SOURCE /* strcasestr */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "sim.h"
+#include "config-area.h"
+#include "config.h"
+#include "log.h"
+#include "clock.h"
+
+/* Bodies go out this much at a time, with pacing between */
+#define SEND_SIZE       (16 * 1024)
+
+/* Jitter is rolled for again after this much of a body */
+#define JITTER_SIZE     (64 * 1024)
+
+/* Requests bigger than this are refused */
+#define REQUEST_SIZE    4096
+
+/* The blank card's config partition */
+#define SIM_CONFIG_SIZE (16 * 1024 * 1024)
+
+/* DNS, as much of it as answering for SIM_HOST takes */
+#define DNS_PACKET_SIZE 512
+#define DNS_TYPE_A      1
+#define DNS_CLASS_IN    1
+
+static const char *sim_root;
+static struct sim_scenario shaping;
+
+struct sim_setting {
+    const char *key;
+    size_t offset;
+};
+
+static const struct sim_setting settings[] = {
+    { "bandwidth_kbps",   offsetof(struct sim_scenario, bandwidth_kbps) },
+    { "latency_ms",       offsetof(struct sim_scenario, latency_ms) },
+    { "jitter_ms",        offsetof(struct sim_scenario, jitter_ms) },
+    { "drop_pct",         offsetof(struct sim_scenario, drop_pct) },
+    { "reset_pct",        offsetof(struct sim_scenario, reset_pct) },
+    { "write_latency_us", offsetof(struct sim_scenario, write_latency_us) },
+    { "connect_ms",       offsetof(struct sim_scenario, connect_ms) },
+    { "dns_ms",           offsetof(struct sim_scenario, dns_ms) },
+};
+
+int load_sim_scenarios(const char *path, struct sim_scenario *s, int max) {
+    char line[256];
+    FILE *f;
+    int n = 0, lineno = 0;
+
+    f = fopen(path, "r");
+    if (!f) {
+        PERROR("Unable to open %s", path);
+        return -1;
+    }
+
+    while (n < max && fgets(line, sizeof(line), f)) {
+        char *word, *save;
+
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        word = strtok_r(line, " \t", &save);
+        if (!word)
+            continue;
+
+        bzero(&s[n], sizeof(s[n]));
+        snprintf(s[n].name, sizeof(s[n].name), "%s", word);
+        while ((word = strtok_r(NULL, " \t", &save))) {
+            char *value = strchr(word, '=');
+            int i;
+
+            if (value)
+                *value++ = '\0';
+            for (i = 0; i < sizeof(settings) / sizeof(*settings); i++)
+                if (!strcmp(word, settings[i].key))
+                    break;
+            if (!value || i == sizeof(settings) / sizeof(*settings)) {
+                ERROR("%s:%d: unknown setting %s", path, lineno, word);
+                fclose(f);
+                return -1;
+            }
+            *(unsigned *)((char *)&s[n] + settings[i].offset)
+                = strtoul(value, NULL, 10);
+        }
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+void set_sim_scenario(const struct sim_scenario *s) {
+    char value[16];
+
+    shaping = *s;
+    snprintf(value, sizeof(value), "%u", s->write_latency_us);
+    config_set("write_latency_us", value);
+}
+
+void sim_connect(const struct sim_scenario *s) {
+    usleep(s->connect_ms * 1000);
+}
+
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void pause_jitter(unsigned *seed) {
+    if (shaping.jitter_ms)
+        usleep(rand_r(seed) % (shaping.jitter_ms + 1) * 1000);
+}
+
+/*
+ * Sends length bytes of fd from offset, paced to the bandwidth.  If
+ * cut_at is inside them, stops there and returns -1 so the connection
+ * is dropped.
+ */
+static int send_body(int sock, int fd, off_t offset, off_t length,
+                     off_t cut_at, unsigned *seed) {
+    unsigned long long start = monotonic_us();
+    char *buf = malloc(SEND_SIZE);
+    off_t sent = 0, next_jitter = JITTER_SIZE;
+    int ret = 0;
+
+    if (!buf)
+        return -1;
+    while (sent < length) {
+        size_t n = length - sent < SEND_SIZE ? length - sent : SEND_SIZE;
+        ssize_t got;
+
+        if (cut_at >= 0 && sent + n > cut_at)
+            n = cut_at - sent;
+        got = n ? pread(fd, buf, n, offset + sent) : 0;
+        if (got <= 0 || send_all(sock, buf, got)) {
+            ret = -1;
+            break;
+        }
+        sent += got;
+        if (cut_at >= 0 && sent >= cut_at) {
+            ret = -1;
+            break;
+        }
+
+        if (shaping.bandwidth_kbps) {
+            unsigned long long due = start
+                + sent * 8000ULL / shaping.bandwidth_kbps;
+            unsigned long long t = monotonic_us();
+            if (due > t)
+                usleep(due - t);
+        }
+        if (sent >= next_jitter) {
+            pause_jitter(seed);
+            next_jitter += JITTER_SIZE;
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+static int send_status(int sock, int code, const char *reason) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+        "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n\r\n", code, reason);
+    return send_all(sock, head, n);
+}
+
+/* Answers one request.  Returns -1 if the connection should close. */
+static int handle_request(int sock, char *request, unsigned *seed) {
+    char path[512], head[512], *range, *p;
+    off_t start = 0, end, cut_at = -1;
+    struct stat st;
+    int fd, n, ret, partial = 0, do_reset = 0;
+
+    if (sscanf(request, "GET %255s HTTP/1.%*d", head) != 1)
+        return send_status(sock, 400, "Bad Request"), -1;
+    if (strstr(head, "..") || head[0] != '/')
+        return send_status(sock, 404, "Not Found");
+    p = strchr(head, '?');
+    if (p)
+        *p = '\0';
+    snprintf(path, sizeof(path), "%s%s", sim_root, head);
+
+    usleep(shaping.latency_ms * 1000);
+    pause_jitter(seed);
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        if (fd != -1)
+            close(fd);
+        return send_status(sock, 404, "Not Found");
+    }
+    end = st.st_size - 1;
+
+    range = strcasestr(request, "\r\nRange: bytes=");
+    if (range) {
+        long long a, b = -1;
+        range += strlen("\r\nRange: bytes=");
+        if (sscanf(range, "%lld-%lld", &a, &b) >= 1 && a < st.st_size) {
+            start = a;
+            if (b >= a && b < end)
+                end = b;
+            partial = 1;
+        }
+        else {
+            close(fd);
+            return send_status(sock, 416, "Range Not Satisfiable");
+        }
+    }
+
+    if (partial)
+        n = snprintf(head, sizeof(head),
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Content-Range: bytes %lld-%lld/%lld\r\n",
+            (long long)start, (long long)end, (long long)st.st_size);
+    else
+        n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n");
+    n += snprintf(head + n, sizeof(head) - n,
+        "Content-Length: %lld\r\n"
+        "ETag: \"sim-%lld-%ld\"\r\n"
+        "Accept-Ranges: bytes\r\n\r\n",
+        (long long)(end - start + 1), (long long)st.st_size,
+        (long)st.st_mtime);
+
+    /* Failures mid-body, which the client has to resume from */
+    if (end > start && (unsigned)(rand_r(seed) % 100) < shaping.drop_pct)
+        cut_at = rand_r(seed) % (end - start + 1);
+    else if (end > start
+          && (unsigned)(rand_r(seed) % 100) < shaping.reset_pct) {
+        cut_at = rand_r(seed) % (end - start + 1);
+        do_reset = 1;
+    }
+
+    ret = send_all(sock, head, n);
+    if (!ret)
+        ret = send_body(sock, fd, start, end - start + 1, cut_at, seed);
+    close(fd);
+
+    if (ret && do_reset) {
+        struct linger l = { 1, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    }
+    if (!ret && strcasestr(request, "\r\nConnection: close"))
+        ret = -1;
+    return ret;
+}
+
+static void *serve_connection(void *arg) {
+    int sock = (long)arg;
+    char buf[REQUEST_SIZE + 1];
+    unsigned seed = monotonic_us() ^ sock;
+    size_t fill = 0;
+
+    for (;;) {
+        char *end;
+        ssize_t n;
+
+        /* Pipelined requests may already be waiting in buf */
+        buf[fill] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+        if (!end) {
+            if (fill == REQUEST_SIZE)
+                break;
+            n = recv(sock, buf + fill, REQUEST_SIZE - fill, 0);
+            if (n <= 0)
+                break;
+            fill += n;
+            continue;
+        }
+
+        end += 4;
+        end[-2] = '\0';
+        if (handle_request(sock, buf, &seed))
+            break;
+        fill -= end - buf;
+        memmove(buf, end, fill);
+    }
+    close(sock);
+    return NULL;
+}
+
+static void *serve(void *arg) {
+    int listener = (long)arg;
+
+    for (;;) {
+        pthread_t thread;
+        long sock = accept(listener, NULL, NULL);
+
+        if (sock == -1) {
+            if (errno == EINTR)
+                continue;
+            PERROR("Simulated server couldn't accept");
+            break;
+        }
+        if (pthread_create(&thread, NULL, serve_connection, (void *)sock)) {
+            close(sock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(listener);
+    return NULL;
+}
+
+int start_sim_server(const char *root) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t thread;
+    long listener;
+
+    sim_root = root;
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == -1) {
+        PERROR("Unable to open a socket");
+        return -1;
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr))
+     || listen(listener, 16)
+     || getsockname(listener, (struct sockaddr *)&addr, &len)) {
+        PERROR("Unable to listen on 127.0.0.1");
+        close(listener);
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, serve, (void *)listener)) {
+        ERROR("Unable to start the simulated server");
+        close(listener);
+        return -1;
+    }
+    pthread_detach(thread);
+    NOTE("Serving %s on 127.0.0.1:%d", root, ntohs(addr.sin_port));
+    return ntohs(addr.sin_port);
+}
+
+
+/* A query being answered, after the scenario's delay */
+struct dns_reply {
+    int fd;
+    struct sockaddr_in from;
+    unsigned char pkt[DNS_PACKET_SIZE];
+    int len;
+};
+
+/*
+ * Turns the query in r->pkt into its answer: one A record of 127.0.0.1
+ * for SIM_HOST, no AAAA records, and NXDOMAIN for any other name.  The
+ * TTL is 0, so every scenario goes through the resolver afresh.
+ * Returns -1 for anything that isn't a plain query.
+ */
+static int answer_query(struct dns_reply *r) {
+    static const unsigned char answer[] = {
+        0xc0, 12,               /* the name in the question */
+        0, DNS_TYPE_A, 0, DNS_CLASS_IN,
+        0, 0, 0, 0,             /* TTL */
+        0, 4, 127, 0, 0, 1,
+    };
+    unsigned char *p = r->pkt + 12;
+    char name[256];
+    int n = 0, type, known;
+
+    if (r->len < 12 || r->pkt[2] & 0x80 || r->pkt[4] || r->pkt[5] != 1)
+        return -1;
+    while (p < r->pkt + r->len && *p) {
+        if (*p > 63 || p + 1 + *p >= r->pkt + r->len
+         || n + *p + 2 > sizeof(name))
+            return -1;
+        if (n)
+            name[n++] = '.';
+        memcpy(name + n, p + 1, *p);
+        n += *p;
+        p += 1 + *p;
+    }
+    name[n] = '\0';
+    if (p + 5 > r->pkt + r->len)
+        return -1;
+    type = p[1] << 8 | p[2];
+    p += 5;
+    known = !strcasecmp(name, SIM_HOST);
+
+    r->pkt[2] = 0x84 | (r->pkt[2] & 0x01);    /* QR, AA, RD as asked */
+    r->pkt[3] = known ? 0x80 : 0x83;            /* RA, NXDOMAIN */
+    memset(r->pkt + 6, 0, 6);
+    if (known && type == DNS_TYPE_A) {
+        r->pkt[7] = 1;
+        memcpy(p, answer, sizeof(answer));
+        p += sizeof(answer);
+    }
+    r->len = p - r->pkt;
+    return 0;
+}
+
+static void *send_reply(void *arg) {
+    struct dns_reply *r = arg;
+
+    usleep(shaping.dns_ms * 1000);
+    sendto(r->fd, r->pkt, r->len, 0, (struct sockaddr *)&r->from,
+           sizeof(r->from));
+    free(r);
+    return NULL;
+}
+
+static void *serve_dns(void *arg) {
+    int fd = (long)arg;
+
+    for (;;) {
+        struct dns_reply *r = malloc(sizeof(*r));
+        socklen_t len = sizeof(r->from);
+        pthread_t thread;
+
+        if (!r)
+            break;
+        r->fd = fd;
+        r->len = recvfrom(fd, r->pkt, sizeof(r->pkt), 0,
+                          (struct sockaddr *)&r->from, &len);
+        if (r->len < 0 && errno != EINTR) {
+            PERROR("Simulated nameserver couldn't receive");
+            free(r);
+            break;
+        }
+        /* Each answer waits out its own delay, as A and AAAA come
+         * together */
+        if (r->len < 0 || answer_query(r)
+         || pthread_create(&thread, NULL, send_reply, r)) {
+            free(r);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(fd);
+    return NULL;
+}
+
+int start_sim_dns(void) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t thread;
+    long fd;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        PERROR("Unable to open a socket");
+        return -1;
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))
+     || getsockname(fd, (struct sockaddr *)&addr, &len)) {
+        PERROR("Unable to bind to 127.0.0.1");
+        close(fd);
+        return -1;
+    }
+    if (pthread_create(&thread, NULL, serve_dns, (void *)fd)) {
+        ERROR("Unable to start the simulated nameserver");
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    NOTE("Answering for %s on 127.0.0.1:%d", SIM_HOST, ntohs(addr.sin_port));
+    return ntohs(addr.sin_port);
+}
+
+
+int make_sim_card(const char *dir, off_t rootfs_size,
+                  char *config_dev, char *rootfs_dev, size_t len) {
+    static const struct {
+        const char *name;
+        unsigned offset, length;
+    } blocks[] = {
+        { "krnA", 0x100000, 0x400000 },
+        { "krnB", 0x500000, 0x400000 },
+        { "logo", 0x900000, 0x100000 },
+    };
+    static const unsigned char version[] = { CONFIG_AREA_VER };
+    struct config_area ca;
+    int fd, i;
+
+    snprintf(config_dev, len, "%s/p1.img", dir);
+    snprintf(rootfs_dev, len, "%s/p2.img", dir);
+
+    memset(&ca, 0, sizeof(ca));
+    memcpy(ca.sig, "Cfg*", 4);
+    memcpy(ca.area_version, version, sizeof(ca.area_version));
+    for (i = 0; i < sizeof(blocks) / sizeof(*blocks); i++) {
+        ca.block_table[i].offset = blocks[i].offset;
+        ca.block_table[i].length = blocks[i].length;
+        memcpy(ca.block_table[i].n.name, blocks[i].name, 4);
+    }
+    ca.block_table[i].offset = 0xffffffff;
+
+    fd = open(config_dev, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        PERROR("Unable to create %s", config_dev);
+        return -1;
+    }
+    if (ftruncate(fd, SIM_CONFIG_SIZE)
+     || pwrite(fd, &ca, sizeof(ca), CONFIG_AREA_PART1_OFFSET) != sizeof(ca)) {
+        PERROR("Unable to write %s", config_dev);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    /* The rootfs starts out blank, as after a fresh partition */
+    fd = open(rootfs_dev, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        PERROR("Unable to create %s", rootfs_dev);
+        return -1;
+    }
+    if (ftruncate(fd, rootfs_size)) {
+        PERROR("Unable to size %s", rootfs_dev);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+#include <sys/types.h>
+
+/*
+ * Stand-ins for the network and the card, so the whole download,
+ * inflate, write and kernel restore path can be timed on a desk.  An
+ * HTTP server thread in this process serves the image with the
+ * scenario's bandwidth, latency and failures, under a name only its
+ * own nameserver answers for; the card is a pair of files; joining the
+ * network is a pause.
+ */
+struct sim_scenario {
+    char name[32];
+    unsigned bandwidth_kbps;    /* per connection, 0 for unlimited */
+    unsigned latency_ms;        /* before each response */
+    unsigned jitter_ms;         /* up to this much more, now and then */
+    unsigned drop_pct;          /* chance a response is cut off part way */
+    unsigned reset_pct;         /* chance it's cut off with a reset */
+    unsigned write_latency_us;  /* added to every card write */
+    unsigned connect_ms;        /* in place of WPA and DHCP */
+    unsigned dns_ms;            /* before each DNS answer */
+};
+
+#define SIM_MAX_SCENARIOS 16
+
+/* The name the image is served under, which only the simulated
+ * nameserver knows */
+#define SIM_HOST "image.sim"
+
+/*
+ * Read scenarios from path, one per line: a name, then key=value
+ * settings named as in struct sim_scenario.  '#' starts a comment.
+ * Returns how many there are, or -1.
+ */
+int load_sim_scenarios(const char *path, struct sim_scenario *s, int max);
+
+/* Serve the files in root on 127.0.0.1.  Returns the port, or -1. */
+int start_sim_server(const char *root);
+
+/*
+ * Answer DNS queries on 127.0.0.1: SIM_HOST is 127.0.0.1, and nothing
+ * else exists.  Returns the port, or -1.
+ */
+int start_sim_dns(void);
+
+/* Shape the server and the card to s from now on */
+void set_sim_scenario(const struct sim_scenario *s);
+
+/* Take as long as s says joining the network does */
+void sim_connect(const struct sim_scenario *s);
+
+/*
+ * Make a blank card in dir: a config partition with krnA, krnB and logo
+ * slots, and an empty root filesystem partition of rootfs_size bytes.
+ * Fills in their paths.  Returns 0 or -1.
+ */
+int make_sim_card(const char *dir, off_t rootfs_size,
+                  char *config_dev, char *rootfs_dev, size_t len);
+#endif /* __SIM_H__ */
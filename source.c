@@ -0,0 +1,439 @@
+#define _GNU_SOURCE /* fopencookie */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "config.h"
+#include "crc32.h"
+#include "source.h"
+#include "wget.h"
+#include "log.h"
+
+#define USB_MOUNTPOINT "/usb"
+
+/* Names we look for in the root of a stick, unless the config says */
+#define USB_IMAGE_NAMES "disk-image.gz", "disk-image.img"
+
+/* How long to wait for a plugged-in stick to show up as a disk */
+#define USB_SETTLE_MS 5000
+
+/* How much of a local image is mapped at once.  A multi-GB image
+ * won't fit in a 32-bit address space in one piece. */
+#define MAP_WINDOW (16 * 1024 * 1024)
+
+static const char *usb_fstypes[] = { "vfat", "ext2", "ext3", "ext4", NULL };
+
+/* Where image's digest is published, or NULL if it isn't checked */
+static const char *digest_location(const char *image, char *buf, int size) {
+    const char *setting = config_get("image_digest");
+
+    if (setting && !strcmp(setting, "off"))
+        return NULL;
+    if (setting)
+        return setting;
+    snprintf(buf, size, "%s.sha256", image);
+    return buf;
+}
+
+/* "<hex digest>  <name>", as sha256sum writes it */
+static int parse_digest(const char *text, unsigned char *digest) {
+    int i;
+
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        unsigned v;
+        if (!isxdigit((unsigned char)text[2 * i])
+         || !isxdigit((unsigned char)text[2 * i + 1])
+         || sscanf(text + 2 * i, "%2x", &v) != 1)
+            return -1;
+        digest[i] = v;
+    }
+    text += 2 * SHA256_DIGEST_SIZE;
+    return *text && !isspace((unsigned char)*text) ? -1 : 0;
+}
+
+static void use_digest(struct image_source *src, const char *where,
+                       const char *text) {
+    if (!text)
+        NOTE("No SHA-256 published at %s", where);
+    else if (parse_digest(text, src->sha256))
+        ERROR("%s doesn't hold a SHA-256 digest", where);
+    else {
+        src->has_sha256 = 1;
+        NOTE("Checking the image against the SHA-256 in %s", where);
+    }
+}
+
+/* The digest beside a local image, if there is one */
+static void load_local_digest(struct image_source *src, const char *path) {
+    char buf[256], line[128];
+    const char *where = digest_location(path, buf, sizeof(buf));
+    FILE *f;
+
+    if (!where)
+        return;
+    f = fopen(where, "r");
+    if (!f) {
+        NOTE("No SHA-256 published at %s", where);
+        return;
+    }
+    use_digest(src, where, fgets(line, sizeof(line), f) ? line : NULL);
+    fclose(f);
+}
+
+static int map_window(struct image_source *src) {
+    off_t left = src->size - src->pos;
+
+    if (src->map)
+        munmap(src->map, src->map_len);
+    src->map = NULL;
+    if (left <= 0)
+        return 0;
+
+    src->map_offset = src->pos;
+    src->map_len = left < MAP_WINDOW ? left : MAP_WINDOW;
+    src->map = mmap(NULL, src->map_len, PROT_READ, MAP_SHARED,
+                    src->fd, src->base + src->map_offset);
+    if (src->map == MAP_FAILED) {
+        PERROR("Unable to map %s", src->name);
+        src->map = NULL;
+        return -1;
+    }
+
+    /* We go through it once, front to back */
+    madvise(src->map, src->map_len, MADV_SEQUENTIAL);
+    madvise(src->map, src->map_len, MADV_WILLNEED);
+
+    /* And start the disk on the window after this one */
+    if (left > (off_t)src->map_len)
+        posix_fadvise(src->fd, src->base + src->map_offset + src->map_len,
+                      MAP_WINDOW, POSIX_FADV_WILLNEED);
+    return 0;
+}
+
+static ssize_t local_read(void *cookie, char *buf, size_t size) {
+    struct image_source *src = cookie;
+    size_t avail;
+
+    if (src->pos >= src->size)
+        return 0;
+    if (!src->map || src->pos >= src->map_offset + (off_t)src->map_len) {
+        if (map_window(src))
+            return -1;
+    }
+
+    avail = src->map_offset + src->map_len - src->pos;
+    if (size > avail)
+        size = avail;
+    memcpy(buf, (char *)src->map + (src->pos - src->map_offset), size);
+    src->pos += size;
+    if (src->from_cache)
+        src->crc = crc32_update(src->crc, buf, size);
+    return size;
+}
+
+static int local_close(void *cookie) {
+    struct image_source *src = cookie;
+
+    if (src->map)
+        munmap(src->map, src->map_len);
+    src->map = NULL;
+    close(src->fd);
+    src->fd = -1;
+    return 0;
+}
+
+/* The image is size bytes at base in path, or all of it if size is 0 */
+static int open_local(struct image_source *src, const char *path,
+                      off_t base, off_t size) {
+    static const cookie_io_functions_t local_funcs = {
+        .read  = local_read,
+        .close = local_close,
+    };
+    unsigned char magic[2];
+    struct stat st;
+
+    src->type = SOURCE_LOCAL;
+    snprintf(src->name, sizeof(src->name), "%s", path);
+    src->fd = open(path, O_RDONLY);
+    if (src->fd == -1)
+        return -1;
+    if (!size && (fstat(src->fd, &st) || !st.st_size)) {
+        ERROR("%s is empty", path);
+        close(src->fd);
+        return -1;
+    }
+    src->base = base;
+    src->size = size ? size : st.st_size;
+    src->pos = 0;
+    src->map = NULL;
+
+    if (map_window(src)) {
+        close(src->fd);
+        return -1;
+    }
+    memcpy(magic, src->map, sizeof(magic));
+    src->is_gzip = magic[0] == 0x1f && magic[1] == 0x8b;
+
+    /* A raw image has to be whole sectors; anything else is a stray file */
+    if (!src->is_gzip && (src->size & 511)) {
+        ERROR("%s is neither gzipped nor a disk image", path);
+        local_close(src);
+        return -1;
+    }
+
+    src->stream = fopencookie(src, "r", local_funcs);
+    if (!src->stream) {
+        PERROR("Unable to create stream for %s", path);
+        local_close(src);
+        return -1;
+    }
+
+    /* Large reads go straight to the map */
+    setvbuf(src->stream, NULL, _IONBF, 0);
+    NOTE("Using local image %s (%lld bytes, %s)", path,
+        (long long)src->size, src->is_gzip ? "gzipped" : "raw");
+    return 0;
+}
+
+int open_local_source(struct image_source *src, const char *path) {
+    if (open_local(src, path, 0, 0))
+        return -1;
+    load_local_digest(src, path);
+    return 0;
+}
+
+/* Flash the copy in the image cache, checking it as it's read */
+static int open_cached_source(struct image_source *src) {
+    struct image_cache *cache = &src->cache;
+
+    if (open_local(src, cache->path, image_cache_offset(cache),
+                   cache->validators.length))
+        return -1;
+    src->from_cache = 1;
+    src->crc = 0;
+    return 0;
+}
+
+/* Is there a USB disk that hasn't got its block device yet? */
+static int usb_disk_pending(void) {
+    DIR *dir;
+    struct dirent *de;
+    int pending = 0;
+
+    dir = opendir("/sys/bus/usb/drivers/usb-storage");
+    if (!dir)
+        return 0;
+    while ((de = readdir(dir)))
+        if (strchr(de->d_name, ':'))
+            pending = 1;
+    closedir(dir);
+    return pending;
+}
+
+/* Create /dev/name from its sysfs entry, if udev didn't */
+static int make_dev_node(const char *sysdir, const char *name, char *dev, int size) {
+    char path[256];
+    unsigned maj, min;
+    FILE *f;
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/dev", sysdir);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    ok = fscanf(f, "%u:%u", &maj, &min) == 2;
+    fclose(f);
+    if (!ok)
+        return -1;
+
+    snprintf(dev, size, "/dev/%.32s", name);
+    if (mknod(dev, S_IFBLK | 0600, makedev(maj, min)) == -1 && errno != EEXIST) {
+        PERROR("Unable to mknod %s", dev);
+        return -1;
+    }
+    return 0;
+}
+
+static int try_mount(const char *dev, struct image_source *src) {
+    const char *names[] = { USB_IMAGE_NAMES, NULL };
+    const char *configured = config_get("usb_image");
+    char path[256];
+    int i;
+
+    mkdir(USB_MOUNTPOINT, 0777);
+    for (i = 0; usb_fstypes[i]; i++)
+        if (!mount(dev, USB_MOUNTPOINT, usb_fstypes[i], MS_RDONLY, NULL))
+            break;
+    if (!usb_fstypes[i])
+        return -1;
+    NOTE("Mounted %s (%s)", dev, usb_fstypes[i]);
+
+    if (configured) {
+        names[0] = configured;
+        names[1] = NULL;
+    }
+    for (i = 0; names[i]; i++) {
+        snprintf(path, sizeof(path), "%s/%s", USB_MOUNTPOINT, names[i]);
+        if (!open_local_source(src, path)) {
+            snprintf(src->mountpoint, sizeof(src->mountpoint), "%s",
+                     USB_MOUNTPOINT);
+            return 0;
+        }
+    }
+
+    umount(USB_MOUNTPOINT);
+    return -1;
+}
+
+int find_usb_image(struct image_source *src) {
+    struct timespec delay = { 0, 250 * 1000000 };
+    int waited = 0;
+    DIR *dir;
+    struct dirent *de;
+
+    bzero(src, sizeof(*src));
+    src->fd = -1;
+
+    for (;;) {
+        int found_disk = 0;
+
+        dir = opendir("/sys/block");
+        if (!dir) {
+            PERROR("Unable to open /sys/block");
+            return -1;
+        }
+        while ((de = readdir(dir))) {
+            char sysdir[64], part[128], name[48], dev[64];
+            int i;
+
+            if (strncmp(de->d_name, "sd", 2) || strlen(de->d_name) > 32)
+                continue;
+            found_disk = 1;
+            snprintf(sysdir, sizeof(sysdir), "/sys/block/%.32s", de->d_name);
+
+            /* Partitions first, then a stick formatted without a table */
+            for (i = 1; i <= 4; i++) {
+                snprintf(name, sizeof(name), "%.32s%d", de->d_name, i);
+                snprintf(part, sizeof(part), "%s/%s", sysdir, name);
+                if (make_dev_node(part, name, dev, sizeof(dev)))
+                    continue;
+                if (!try_mount(dev, src)) {
+                    closedir(dir);
+                    return 0;
+                }
+            }
+            if (!make_dev_node(sysdir, de->d_name, dev, sizeof(dev))
+             && !try_mount(dev, src)) {
+                closedir(dir);
+                return 0;
+            }
+        }
+        closedir(dir);
+
+        if (found_disk || !usb_disk_pending() || waited >= USB_SETTLE_MS)
+            break;
+        nanosleep(&delay, NULL);
+        waited += 250;
+    }
+
+    NOTE("No image found on USB storage");
+    return -1;
+}
+
+int open_http_source(struct image_source *src, const char *url,
+                     const char *card) {
+    const char *cache_path;
+    char digest_url[512];
+    struct wget_fetch digest;
+    unsigned char magic[2];
+    int use_cache, ndigest;
+
+    bzero(src, sizeof(*src));
+    src->fd = -1;
+    src->type = SOURCE_HTTP;
+    snprintf(src->name, sizeof(src->name), "%s", url);
+
+    /* Keep the download in spare card space, unless told otherwise or
+     * there's no card being recovered */
+    cache_path = config_get("image_cache");
+    if (cache_path && !strcmp(cache_path, "off"))
+        use_cache = 0;
+    else if (cache_path && strcmp(cache_path, "card"))
+        use_cache = load_image_cache(&src->cache, cache_path) != -2;
+    else if (card)
+        use_cache = load_card_cache(&src->cache, card, url) != -2;
+    else
+        use_cache = 0;
+
+    /* The digest rides ahead of the image on the same connection */
+    digest.url = (char *)digest_location(url, digest_url, sizeof(digest_url));
+    ndigest = !!digest.url;
+
+    /* With a copy from an earlier run, only download if it's changed */
+    if (use_cache) {
+        src->stream = start_wget_conditional(src->name, &src->size,
+                                             &src->cache.validators,
+                                             &digest, ndigest);
+        if (ndigest) {
+            use_digest(src, digest.url, digest.data);
+            free(digest.data);
+        }
+        if (!src->stream && src->cache.valid) {
+            if (src->cache.validators.not_modified)
+                NOTE("Image unchanged, flashing the cached copy");
+            else
+                NOTE("Couldn't download image, flashing the cached copy");
+            return open_cached_source(src);
+        }
+    }
+    else {
+        src->stream = start_wget_pipelined(src->name, &src->size,
+                                           &digest, ndigest);
+        if (ndigest) {
+            use_digest(src, digest.url, digest.data);
+            free(digest.data);
+        }
+    }
+    if (!src->stream)
+        return -1;
+
+    src->is_gzip = peek_wget(src->stream, magic, sizeof(magic)) == sizeof(magic)
+                && magic[0] == 0x1f && magic[1] == 0x8b;
+
+    /* Raw images are as big as the partition, so aren't cached */
+    if (use_cache && src->is_gzip)
+        src->stream = tee_image_cache(&src->cache, src->stream);
+    return 0;
+}
+
+void close_source(struct image_source *src) {
+    if (src->stream)
+        fclose(src->stream);
+    src->stream = NULL;
+
+    /* A cached copy that couldn't be flashed all the way through, or
+     * didn't match its checksum, would only fail the same way again */
+    if (src->from_cache && (src->pos != src->size || src->bad
+     || (src->cache.has_crc && src->crc != src->cache.crc))) {
+        ERROR("Cached image didn't flash cleanly (%lld of %lld bytes read)",
+            (long long)src->pos, (long long)src->size);
+        invalidate_image_cache(&src->cache);
+    }
+    src->from_cache = 0;
+    if (src->mountpoint[0]) {
+        if (umount(src->mountpoint))
+            PERROR("Unable to unmount %s", src->mountpoint);
+        src->mountpoint[0] = '\0';
+    }
+    close_wget_pool();
+}
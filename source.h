@@ -0,0 +1,56 @@
+#ifndef __SOURCE_H__
+#define __SOURCE_H__
+#include <stdio.h>
+#include <sys/types.h>
+#include "image-cache.h"
+#include "sha256.h"
+
+#define SOURCE_HTTP  1
+#define SOURCE_LOCAL 2
+
+/* Where the disk image comes from: the network, or a file on a USB
+ * stick (or any other local path) */
+struct image_source {
+    int type;
+    char name[256];         /* URL or path, for the logs */
+    FILE *stream;           /* the image, as stored */
+    off_t size;             /* bytes in the stream, 0 if unknown */
+    int is_gzip;
+
+    /* What the image, as stored, hashes to, if that's published beside
+     * it as "<image>.sha256" */
+    unsigned char sha256[SHA256_DIGEST_SIZE];
+    int has_sha256;
+    int bad;                /* it didn't */
+
+    /* SOURCE_LOCAL: the file, read through a sliding mmap() window */
+    int fd;
+    char mountpoint[64];    /* what we mounted to get at it, if anything */
+    void *map;
+    off_t map_offset;
+    size_t map_len;
+    off_t pos;
+    off_t base;             /* where in the file the image starts */
+
+    /* SOURCE_HTTP, and the image cache's copy when that's flashed
+     * instead */
+    struct image_cache cache;
+    int from_cache;
+    uint32_t crc;           /* of what's been read of the copy */
+};
+
+/* Look for an image on a USB stick, mounting it read-only.  Returns 0
+ * and fills src in if there's a usable one. */
+int find_usb_image(struct image_source *src);
+
+/* Open an image file */
+int open_local_source(struct image_source *src, const char *path);
+
+/* Start downloading url, or reuse a cached copy if it's still current.
+ * The copy is kept on card, or in the file image_cache names; card is
+ * NULL when the image isn't going onto one. */
+int open_http_source(struct image_source *src, const char *url,
+                     const char *card);
+
+void close_source(struct image_source *src);
+#endif /* __SOURCE_H__ */
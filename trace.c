@@ -0,0 +1,218 @@
+#define _GNU_SOURCE /* syscall() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "clock.h"
+#include "config.h"
+#include "log.h"
+
+/* Events the buffer holds; later ones are counted and dropped */
+#define TRACE_EVENTS    16384
+
+struct trace_event {
+    unsigned long long ts;
+    unsigned long long dur;     /* 'X' */
+    long long value;            /* 'C' */
+    int pid, tid;
+    volatile char ready;        /* set once the rest is filled in */
+    char phase;
+    char cat[10];
+    char name[44];
+};
+
+struct trace_buffer {
+    unsigned next;              /* claimed with an atomic add */
+    int finished;
+    struct trace_event events[TRACE_EVENTS];
+};
+
+static struct trace_buffer *trace;
+
+int trace_init(void) {
+    const char *setting = config_get("trace");
+
+    if (trace)
+        return 0;
+    if (setting && !strcmp(setting, "off"))
+        return -1;
+    trace = mmap(NULL, sizeof(*trace), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace == MAP_FAILED) {
+        PERROR("Unable to map the trace buffer");
+        trace = NULL;
+        return -1;
+    }
+    trace_process_name("netv-recovery");
+    return 0;
+}
+
+static struct trace_event *add_event(char phase, const char *cat,
+                                     const char *name) {
+    struct trace_event *e;
+    unsigned n;
+
+    if (!trace)
+        return NULL;
+    n = __sync_fetch_and_add(&trace->next, 1);
+    if (n >= TRACE_EVENTS)
+        return NULL;
+    e = &trace->events[n];
+    e->ts = monotonic_us();
+    e->pid = getpid();
+    e->tid = syscall(SYS_gettid);
+    e->phase = phase;
+    snprintf(e->cat, sizeof(e->cat), "%s", cat);
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    return e;
+}
+
+static void publish(struct trace_event *e) {
+    __sync_synchronize();
+    e->ready = 1;
+}
+
+void trace_begin(const char *cat, const char *name) {
+    struct trace_event *e = add_event('B', cat, name);
+    if (e)
+        publish(e);
+}
+
+void trace_end(const char *cat, const char *name) {
+    struct trace_event *e = add_event('E', cat, name);
+    if (e)
+        publish(e);
+}
+
+void trace_span(const char *cat, const char *name,
+                unsigned long long start_us, unsigned long long dur_us) {
+    struct trace_event *e = add_event('X', cat, name);
+    if (e) {
+        e->ts = start_us;
+        e->dur = dur_us;
+        publish(e);
+    }
+}
+
+void trace_instant(const char *cat, const char *name) {
+    struct trace_event *e = add_event('i', cat, name);
+    if (e)
+        publish(e);
+}
+
+void trace_counter(const char *cat, const char *name, long long value) {
+    struct trace_event *e = add_event('C', cat, name);
+    if (e) {
+        e->value = value;
+        publish(e);
+    }
+}
+
+void trace_process_name(const char *name) {
+    struct trace_event *e = add_event('M', "", name);
+    if (e)
+        publish(e);
+}
+
+static void put_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < ' ')
+            fprintf(out, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+int trace_dump(FILE *out) {
+    unsigned n, i, written = 0;
+
+    if (!trace)
+        return -1;
+    n = trace->next;
+    if (n > TRACE_EVENTS)
+        n = TRACE_EVENTS;
+
+    fputs("{\"traceEvents\":[\n", out);
+    for (i = 0; i < n; i++) {
+        struct trace_event *e = &trace->events[i];
+
+        if (!e->ready)
+            continue;
+        if (written++)
+            fputs(",\n", out);
+        if (e->phase == 'M') {
+            fprintf(out, "{\"ph\":\"M\",\"name\":\"process_name\","
+                         "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                    e->pid, e->tid);
+            put_string(out, e->name);
+            fputs("}}", out);
+            continue;
+        }
+        fprintf(out, "{\"ph\":\"%c\",\"cat\":", e->phase);
+        put_string(out, e->cat);
+        fputs(",\"name\":", out);
+        put_string(out, e->name);
+        fprintf(out, ",\"ts\":%llu,\"pid\":%d,\"tid\":%d",
+                e->ts, e->pid, e->tid);
+        if (e->phase == 'X')
+            fprintf(out, ",\"dur\":%llu", e->dur);
+        else if (e->phase == 'C')
+            fprintf(out, ",\"args\":{\"value\":%lld}", e->value);
+        else if (e->phase == 'i')
+            fputs(",\"s\":\"p\"", out);
+        fputc('}', out);
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":"
+                 "{\"dropped\":%u}}\n",
+            trace->next > TRACE_EVENTS ? trace->next - TRACE_EVENTS : 0);
+    fflush(out);
+    return ferror(out) ? -1 : 0;
+}
+
+void trace_finish(void) {
+    const char *path = config_get("trace_file");
+    FILE *out;
+
+    if (!trace || __sync_lock_test_and_set(&trace->finished, 1))
+        return;
+    if (path) {
+        out = fopen(path, "w");
+        if (!out) {
+            PERROR("Unable to write the trace to %s", path);
+            return;
+        }
+        if (trace_dump(out))
+            ERROR("Unable to write the trace to %s", path);
+        else
+            NOTE("Wrote the trace to %s", path);
+        fclose(out);
+    }
+    else if (serial_output) {
+        NOTE("Trace follows");
+        trace_dump(serial_output);
+    }
+}
+
+void trace_reset(void) {
+    unsigned n, i;
+
+    if (!trace)
+        return;
+    n = trace->next;
+    if (n > TRACE_EVENTS)
+        n = TRACE_EVENTS;
+    for (i = 0; i < n; i++)
+        trace->events[i].ready = 0;
+    __sync_synchronize();
+    trace->next = 0;
+    trace->finished = 0;
+    trace_process_name("netv-recovery");
+}
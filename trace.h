@@ -0,0 +1,41 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+#include <stdio.h>
+
+/*
+ * A timeline of the whole run, for chrome://tracing or Perfetto.
+ * Events go into a fixed buffer of shared memory, so the udev and DHCP
+ * children forked off later record into the same one.  Names are
+ * copied, and cut short if they're long.  Everything here is a no-op
+ * until trace_init() has worked.
+ */
+
+/* Set up the buffer, unless "trace" is "off".  Call it before anything
+ * forks.  Returns 0, or -1 if there's no tracing. */
+int trace_init(void);
+
+/* A span on this thread; ends pair up with the latest begin */
+void trace_begin(const char *cat, const char *name);
+void trace_end(const char *cat, const char *name);
+
+/* A span that's already over, timed with monotonic_us() */
+void trace_span(const char *cat, const char *name,
+                unsigned long long start_us, unsigned long long dur_us);
+
+/* A single moment, and a value to plot over time */
+void trace_instant(const char *cat, const char *name);
+void trace_counter(const char *cat, const char *name, long long value);
+
+/* What to call this process in the viewer */
+void trace_process_name(const char *name);
+
+/* Write everything so far as trace-event JSON.  Returns 0 or -1. */
+int trace_dump(FILE *out);
+
+/* Dump to the file "trace_file" names, or else to serial_output */
+void trace_finish(void);
+
+/* Empty the buffer for another run in this process, once nothing else
+ * is recording, so it can be traced and finished afresh */
+void trace_reset(void);
+#endif /* __TRACE_H__ */
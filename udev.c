@@ -13,6 +13,7 @@
 #include <string.h>
 #include <errno.h>
 #include "log.h"
+#include "trace.h"
 
 #ifdef DBG
 #define DEBUG_ADD(format, arg...)            \
@@ -185,6 +186,7 @@ int udev_main(void) {
 
 	if ((pid=fork()))
 		return pid;
+	trace_process_name("udev");
 
 
 	while(1) {
@@ -204,8 +206,11 @@ int udev_main(void) {
 		print_rule(data, bytes);
 #endif
 
-		if (is_firmware_rule(data, bytes))
+		if (is_firmware_rule(data, bytes)) {
+			trace_begin("firmware", "load_firmware");
 			load_firmware(data, bytes);
+			trace_end("firmware", "load_firmware");
+		}
 	}
 
 	exit(3);
@@ -1,10 +1,14 @@
+#include "ufdisk.h"
 #if defined(linux) && defined(DANGEROUS)
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <linux/fs.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 
@@ -14,10 +18,18 @@
 #if !defined(BLKGETSIZE64)
 # define BLKGETSIZE64 _IOR(0x12,114,size_t)
 #endif
+#if !defined(BLKIOOPT)
+# define BLKIOOPT _IO(0x12,121)
+#endif
 
 #define CONFIG_SIZE 16384
 #define RFS_SIZE 500000
 
+/* Partitions after the first start and end on the card's erase
+ * blocks, or on megabytes if it doesn't say or says something odd */
+#define MIN_ALIGN (1024 * 1024)
+#define MAX_ALIGN (64 * 1024 * 1024)
+
 typedef uint32_t sector_t;
 typedef unsigned long long uoff_t;
 
@@ -80,46 +92,119 @@ ret_trunc:
 }
 
 
-int
-prepare_partitions(void)
+/*
+ * The card's preferred erase size in bytes: MMC reports it for the
+ * card, other block devices (loop devices, USB readers) may have an
+ * optimal I/O size.  0 if neither is known.
+ */
+static unsigned long
+erase_size(int fd)
 {
-    struct mbr mbr;
-    int fd;
-    sector_t last_sector;
-    
-    fd = open("/dev/mmcblk0", O_RDWR);
-    if (fd == -1) {
-        perror("Unable to open MMC card");
-        return -1;
+    struct stat st;
+    char path[96];
+    unsigned long size = 0;
+    unsigned int opt = 0;
+    FILE *f;
+
+    if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+        return 0;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/device/preferred_erase_size",
+             major(st.st_rdev), minor(st.st_rdev));
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%lu", &size) != 1)
+            size = 0;
+        fclose(f);
     }
-    bzero(&mbr, sizeof(mbr));
+    if (!size && !ioctl(fd, BLKIOOPT, &opt))
+        size = opt;
+    return size;
+}
+
+/*
+ * Work out the partition table for the card behind fd.  Partition 1
+ * holds the boot stream and the config area at a fixed offset from its
+ * start, so it stays exactly where it's always been.  The root
+ * filesystem after it, and the spare space after that, start and end
+ * on erase blocks, so the card never has to read-modify-write a block
+ * shared with a neighbour.
+ */
+static int
+layout_partitions(int fd, struct mbr *mbr, sector_t *spare_end)
+{
+    sector_t last_sector, align, end;
+    unsigned long erase;
 
     last_sector = bb_BLKGETSIZE_sectors(fd);
-    if (!last_sector) {
-        close(fd);
+    if (!last_sector)
         return -2;
-    }
 
-    mbr.signature[0] = 0x55;
-    mbr.signature[1] = 0xAA;
+    erase = erase_size(fd);
+    if (erase < MIN_ALIGN || erase > MAX_ALIGN || erase % 512)
+        erase = MIN_ALIGN;
+    align = erase / 512;
 
-    mbr.partitions[0].status = 0x80;
-    mbr.partitions[0].lba_address = 4;
-    mbr.partitions[0].lba_size = CONFIG_SIZE*2;
-    mbr.partitions[0].type = 0x53;
+    bzero(mbr, sizeof(*mbr));
+    mbr->signature[0] = 0x55;
+    mbr->signature[1] = 0xAA;
 
-    mbr.partitions[1].status = 0x00;
-    mbr.partitions[1].lba_address = mbr.partitions[0].lba_address + mbr.partitions[0].lba_size;
-    mbr.partitions[1].lba_size = RFS_SIZE*2;
-    mbr.partitions[1].type = 0x83;
+    mbr->partitions[0].status = 0x80;
+    mbr->partitions[0].lba_address = 4;
+    mbr->partitions[0].lba_size = CONFIG_SIZE*2;
+    mbr->partitions[0].type = 0x53;
+
+    mbr->partitions[1].status = 0x00;
+    end = mbr->partitions[0].lba_address + mbr->partitions[0].lba_size;
+    mbr->partitions[1].lba_address = (end + align - 1) / align * align;
+    end = mbr->partitions[1].lba_address + RFS_SIZE*2;
+    mbr->partitions[1].lba_size = (end + align - 1) / align * align
+                                - mbr->partitions[1].lba_address;
+    mbr->partitions[1].type = 0x83;
 
 /*
-    mbr.partitions[2].status = 0x00;
-    mbr.partitions[2].lba_address = mbr.partitions[1].lba_address + mbr.partitions[1].lba_size;
-    mbr.partitions[2].lba_size = last_sector - mbr.partitions[2].lba_address - 100;
-    mbr.partitions[2].type = 0x83;
+    mbr->partitions[2].status = 0x00;
+    mbr->partitions[2].lba_address = mbr->partitions[1].lba_address + mbr->partitions[1].lba_size;
+    mbr->partitions[2].lba_size = last_sector - mbr->partitions[2].lba_address - 100;
+    mbr->partitions[2].type = 0x83;
 */
 
+    if (spare_end) {
+        end = last_sector > 100 ? last_sector - 100 : 0;
+        *spare_end = end / align * align;
+    }
+
+    return 0;
+}
+
+int
+prepare_partitions(const char *dev)
+{
+    struct mbr mbr, current;
+    int fd, ret;
+    
+    fd = open(dev, O_RDWR);
+    if (fd == -1) {
+        perror("Unable to open MMC card");
+        return -1;
+    }
+
+    ret = layout_partitions(fd, &mbr, NULL);
+    if (ret) {
+        close(fd);
+        return ret;
+    }
+    fprintf(stderr, "Root filesystem goes at sector %u, %u sectors long\n",
+            mbr.partitions[1].lba_address, mbr.partitions[1].lba_size);
+
+    /* Already laid out like this: leave it, and spare the card the
+     * flush and rescan that rereading the table costs */
+    if (sizeof(current) == pread(fd, &current, sizeof(current), 0)
+     && !memcmp(&current, &mbr, sizeof(mbr))) {
+        fprintf(stderr, "Partition table is already in place\n");
+        close(fd);
+        return 0;
+    }
+
     if (-1 == lseek(fd, 0, SEEK_SET)) {
         perror("Unable to seek");
         close(fd);
@@ -140,13 +225,56 @@ prepare_partitions(void)
     }
 
     close(fd);
+    return 1;
+}
+
+int
+cache_region(const char *dev, off_t *offset, off_t *length)
+{
+    struct mbr mbr, current;
+    int fd, ret;
+    sector_t start, end;
+
+    fd = open(dev, O_RDONLY);
+    if (fd == -1) {
+        perror("Unable to open MMC card");
+        return -1;
+    }
+    ret = layout_partitions(fd, &mbr, &end);
+    if (!ret && sizeof(current) != pread(fd, &current, sizeof(current), 0))
+        ret = -1;
+    close(fd);
+    if (ret)
+        return -1;
+
+    /* Only a disk already partitioned as above: anything else may
+     * have a filesystem out there */
+    if (memcmp(current.partitions, mbr.partitions, sizeof(mbr.partitions))
+     || memcmp(current.signature, mbr.signature, sizeof(mbr.signature))) {
+        fprintf(stderr, "%s isn't partitioned for an image cache\n", dev);
+        return -3;
+    }
+
+    /* Whatever's past the root filesystem, as laid out above */
+    start = mbr.partitions[1].lba_address + mbr.partitions[1].lba_size;
+    if (end <= start)
+        return -2;
+
+    *offset = start * 512ULL;
+    *length = (end - start) * 512ULL;
     return 0;
 }
 
 #else
 
 int
-prepare_partitions(void)
+prepare_partitions(const char *dev)
+{
+    return -6;
+}
+
+int
+cache_region(const char *dev, off_t *offset, off_t *length)
 {
     return -6;
 }
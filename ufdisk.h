@@ -1,4 +1,18 @@
 #ifndef __UFDISK_H__
 #define __UFDISK_H__
-int prepare_partitions(void);
+#include <sys/types.h>
+
+/* The card everything's recovered onto */
+#define CARD_DEVICE "/dev/mmcblk0"
+
+/* Write the partition table to dev, unless it's already there.  Root
+ * filesystem and spare space are aligned to the card's erase blocks.
+ * Returns 0 if it was there, 1 if it's been written, or negative. */
+int prepare_partitions(const char *dev);
+
+/* Card space that no partition uses, past the root filesystem, for
+ * keeping a copy of the image.  Returns 0 and fills in the byte range
+ * on dev, only if dev's partition table is the one prepare_partitions()
+ * writes. */
+int cache_region(const char *dev, off_t *offset, off_t *length);
 #endif /* __UFDISK_H__ */
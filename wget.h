@@ -1,4 +1,43 @@
 #ifndef __WGET_H__
 #define __WGET_H__
-FILE *start_wget(char *url, int *total_size);
+#include <stdio.h>
+#include <sys/types.h>
+
+/* A small resource (checksum, manifest...) fetched into memory */
+struct wget_fetch {
+    char *url;
+    char *data;     /* malloc()ed and NUL-terminated, NULL on failure */
+    int len;
+    int status;     /* HTTP status, or -1 if it couldn't be fetched */
+};
+
+#define WGET_VALIDATOR_MAX 128
+
+/* What identifies the copy of a resource we already have */
+struct wget_validators {
+    char etag[WGET_VALIDATOR_MAX];          /* empty if unknown */
+    char last_modified[WGET_VALIDATOR_MAX]; /* empty if unknown */
+    off_t length;                           /* -1 if unknown */
+    int not_modified;                       /* the server said 304 */
+};
+
+/* A run of bytes to fetch from a resource */
+struct wget_range {
+    off_t start;
+    off_t length;
+};
+
+FILE *start_wget(char *url, off_t *total_size);
+FILE *start_wget_conditional(char *url, off_t *total_size,
+                             struct wget_validators *cond,
+                             struct wget_fetch *meta, int nmeta);
+FILE *start_wget_pipelined(char *url, off_t *total_size,
+                           struct wget_fetch *meta, int nmeta);
+int fetch_wget(struct wget_fetch *fetch);
+int fetch_wget_ranges(char *url, const struct wget_range *ranges, int nranges,
+                      int (*put)(void *, off_t, const void *, size_t),
+                      void *dat);
+int peek_wget(FILE *stream, void *buf, int len);
+void close_wget_pool(void);
+void report_wget_stats(void);
 #endif /* __WGET_H__ */